@@ -0,0 +1,445 @@
+/*
+   cube_bench: time the RGB to YUY2 converters outside the X server.
+
+   Every converter built into the driver turns a few synthetic frames into
+   YUY2, through cube_convert_runs() as the driver's flushes do, and the
+   throughput is reported per workload. The destination is ordinary memory,
+   or with -f the framebuffer device itself, whose uncached stores are a
+   good part of the cost on the console. -S times the staged write strategy
+   (cube_convert_staged()) instead. A converter with row kernels is timed
+   once more without them, as name/span, to show what they buy. The converters of a depth and chroma
+   quality are also checked against each other, row kernels included (-s
+   720x480 for the PAL ones), and the exit status says whether they agree.
+
+   usage: cube_bench [-f device] [-s WxH] [-t msecs] [-m MHz] [-S] [converter...]
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <linux/fb.h>
+
+#include "cube_convert.h"
+
+#define BENCH_BOX_W	16	/* the scattered boxes, about a glyph each */
+#define BENCH_BOX_H	16
+#define BENCH_BOXES	256	/* per pass */
+
+typedef enum { NOISE, SOLID, TEXT, BOXES, WORKLOADS } workload_t;
+
+static const char *workload_names[WORKLOADS] = {
+	"noise", "solid", "text", "boxes"
+};
+
+static int width = 640, height = 480;
+static u8 *dst;			/* YUY2, either memory or the framebuffer */
+static u32 dst_pitch;
+static u8 *src[WORKLOADS];	/* one frame per workload, at 4 bytes a pixel */
+static unsigned seed = 1;
+
+/* how the rows get converted: with the direct or the staged write strategy */
+static int (*convert_row)(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+			  u32 *dst32, const u32 *src32, int pairs) = cube_convert_runs;
+static CUBEConvertCtx ctx;
+
+static unsigned
+bench_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static u32
+bench_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* the CPU clock, for cycles per pixel; 0 when it can't be found */
+static double
+bench_mhz(void)
+{
+	char line[256];
+	double mhz = 0;
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		/* "clock : 729.000000MHz" on PowerPC, "cpu MHz : 2400.000" on x86 */
+		if ((!strncmp(line, "clock", 5) || !strncmp(line, "cpu MHz", 7)) &&
+		    sscanf(strchr(line, ':') ? strchr(line, ':') + 1 : line, "%lf",
+			   &mhz) == 1)
+			break;
+	}
+	fclose(f);
+	return mhz;
+}
+
+/* x8r8g8b8 to RGB565, for the 16 bit frames */
+static u16
+bench_rgb16(u32 rgb)
+{
+	return ((rgb >> 8) & 0xf800) | ((rgb >> 5) & 0x07e0) | ((rgb >> 3) & 0x001f);
+}
+
+/* and to RGB555, for the 15 bit ones */
+static u16
+bench_rgb15(u32 rgb)
+{
+	return ((rgb >> 9) & 0x7c00) | ((rgb >> 6) & 0x03e0) | ((rgb >> 3) & 0x001f);
+}
+
+static void
+bench_pixel(u8 *frame, int depth, int x, int y, u32 rgb)
+{
+	if (depth == 15)
+		((u16 *) frame)[y * width + x] = bench_rgb15(rgb);
+	else if (depth == 16)
+		((u16 *) frame)[y * width + x] = bench_rgb16(rgb);
+	else
+		((u32 *) frame)[y * width + x] = rgb;
+}
+
+/*
+ * The workloads, in the layout the shadow has for depth: noise, a solid fill,
+ * dark text on a light background in 8x16 cells, and for the scattered
+ * boxes the text again.
+ */
+static void
+bench_frames(int depth)
+{
+	static const u32 solid = 0x3a6ea5;	/* a desktop background */
+	int w, x, y, cx, cy;
+	u32 glyph;
+
+	for (w = 0; w < WORKLOADS; w++) {
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				switch (w) {
+				case NOISE:
+					bench_pixel(src[w], depth, x, y, bench_random() & 0xffffff);
+					break;
+				case SOLID:
+					bench_pixel(src[w], depth, x, y, solid);
+					break;
+				default:
+					/* a glyph per cell, a few strokes of it per row */
+					cx = x / 8;
+					cy = y / 16;
+					glyph = (cx * 2654435761u) ^ (cy * 40503u) ^ (y % 16);
+					glyph = (cx % 80 > 60 || y % 16 > 12) ? 0 : glyph * 2246822519u;
+					bench_pixel(src[w], depth, x, y,
+						    (glyph >> (x % 8 * 4)) & 1 ? 0x202020 : 0xf0f0f0);
+					break;
+				}
+			}
+		}
+	}
+}
+
+/* One pass over the workload; returns the pixels converted */
+static long
+bench_pass(const CUBEConverterRec *conv, workload_t w)
+{
+	int spp = conv->bpp / 8;	/* source bytes per pixel */
+	int i, x, y, y2;
+
+	if (w != BOXES) {
+		for (y = 0; y < height; y++) {
+			cube_dither_row(&ctx, y);
+			convert_row(&ctx, conv, (u32 *) (dst + y * dst_pitch),
+				    (u32 *) (src[w] + y * width * spp), width / 2);
+		}
+		return (long) width * height;
+	}
+
+	for (i = 0; i < BENCH_BOXES; i++) {
+		x = (bench_random() % (width - BENCH_BOX_W)) & ~1;
+		y = bench_random() % (height - BENCH_BOX_H);
+		for (y2 = y + BENCH_BOX_H; y < y2; y++) {
+			cube_dither_row(&ctx, y);
+			convert_row(&ctx, conv, (u32 *) (dst + y * dst_pitch) + x / 2,
+				    (u32 *) (src[w] + (y * width + x) * spp),
+				    BENCH_BOX_W / 2);
+		}
+	}
+	return (long) BENCH_BOXES * BENCH_BOX_W * BENCH_BOX_H;
+}
+
+/* Time conv on every workload, through its row kernel for the width or not */
+static void
+bench_run(const CUBEConverterRec *conv, int rows, u32 msecs, double mhz)
+{
+	char name[32];
+	long pixels;
+	u32 start, elapsed, total;
+	double best;
+	int w;
+
+	snprintf(name, sizeof(name), "%s%s", conv->name, rows ? "" : "/span");
+	printf("%-10s %5d", name, conv->depth);
+	cube_convert_rows(&ctx, conv, rows ? width / 2 : 0);
+	for (w = 0; w < WORKLOADS; w++) {
+		/* the fastest pass, the one the rest of the machine disturbed least */
+		best = 0;
+		total = 0;
+		do {
+			start = bench_time();
+			pixels = bench_pass(conv, w);
+			elapsed = bench_time() - start;
+			total += elapsed;
+			if (elapsed && (!best || (double) pixels / elapsed > best))
+				best = (double) pixels / elapsed;
+		} while (total < msecs * 1000);
+
+		if (mhz > 0)
+			printf("  %7.2f %6.1f", best, mhz / best);
+		else
+			printf("  %7.2f %6s", best, "-");
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/* RGB555 widened to x8r8g8b8, the way the driver's tables widen it */
+static u32
+bench_rgb15to32(u16 p)
+{
+	return (((p >> 10) & 0x1f) * 0xff / 0x1f) << 16 |
+	       (((p >> 5) & 0x1f) * 0xff / 0x1f) << 8 | ((p & 0x1f) * 0xff / 0x1f);
+}
+
+/*
+ * Depth 15 has no converter to check against but its own, so a row of it
+ * is checked against the depth 24 one on its pixels widened: the lumas have
+ * to be the same, and the chroma too where a pair's pixels are. (Elsewhere
+ * the mean is taken of the narrow pixels, which rounds differently.)
+ */
+static int
+bench_check15(const u32 *got, const u32 *row, int pairs)
+{
+	const u16 *p = (const u16 *) row;
+	u32 want, mask;
+	int i;
+
+	for (i = 0; i < pairs; i++, p += 2) {
+		want = rgbrgb32toyuy2(bench_rgb15to32(p[0]), bench_rgb15to32(p[1]));
+		mask = (p[0] & 0x7fff) == (p[1] & 0x7fff) ? 0xffffffff : 0xff00ff00;
+		if ((got[i] ^ want) & mask)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Every converter of a depth has to agree with the first one of it and its
+ * chroma quality, on every workload, straight and through both write
+ * strategies; so do its row kernels that fit in a row, over their width.
+ * At depth 15 the reference itself is checked with bench_check15().
+ */
+static int
+bench_check(const CUBEConverterRec *conv, const CUBEConverterRec *ref)
+{
+	int spp = conv->bpp / 8, pairs = width / 2;
+	const CUBERowKernelRec *k;
+	u32 *want, *got;
+	int w, y, bad = 0;
+
+	want = malloc(pairs * sizeof(u32));
+	got = malloc(pairs * sizeof(u32));
+	if (!want || !got) {
+		fprintf(stderr, "cube_bench: out of memory\n");
+		exit(1);
+	}
+	cube_convert_rows(&ctx, conv, pairs);
+
+	for (w = 0; w < WORKLOADS && !bad; w++) {
+		for (y = 0; y < height && !bad; y++) {
+			const u32 *row = (const u32 *) (src[w] + y * width * spp);
+
+			cube_dither_row(&ctx, y);
+			ref->convert(want, row, pairs, &ctx);
+			if (conv->depth == 15 && conv->chroma == CUBE_CHROMA_FAST &&
+			    bench_check15(want, row, pairs)) {
+				fprintf(stderr, "cube_bench: %s differs from depth 24,"
+					" %s row %d\n", ref->name, workload_names[w], y);
+				bad = 1;
+				break;
+			}
+			conv->convert(got, row, pairs, &ctx);
+			bad = memcmp(want, got, pairs * sizeof(u32)) != 0;
+			if (!bad) {
+				cube_convert_runs(&ctx, conv, got, row, pairs);
+				bad = memcmp(want, got, pairs * sizeof(u32)) != 0;
+			}
+			if (!bad) {
+				cube_convert_staged(&ctx, conv, got, row, pairs);
+				bad = memcmp(want, got, pairs * sizeof(u32)) != 0;
+			}
+			for (k = conv->rows; k && k->pairs && !bad; k++) {
+				if (k->pairs > pairs)
+					continue;
+				ref->convert(want, row, k->pairs, &ctx);
+				k->convert(got, row, k->pairs, &ctx);
+				bad = memcmp(want, got, k->pairs * sizeof(u32)) != 0;
+			}
+			if (bad)
+				fprintf(stderr, "cube_bench: %s differs from %s, %s row %d\n",
+					conv->name, ref->name, workload_names[w], y);
+		}
+	}
+
+	free(want);
+	free(got);
+	return bad;
+}
+
+/* Point dst at the framebuffer; the pixels are whatever it is set up for */
+static void
+bench_map(const char *device)
+{
+	struct fb_fix_screeninfo finfo;
+	int fd;
+	void *map;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0 || ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (finfo.line_length < (u32) width * 2 ||
+	    finfo.smem_len < finfo.line_length * height) {
+		fprintf(stderr, "cube_bench: %s is too small for %dx%d\n",
+			device, width, height);
+		exit(1);
+	}
+	map = mmap(NULL, finfo.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(device);
+		exit(1);
+	}
+	dst = map;
+	dst_pitch = finfo.line_length;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: cube_bench [-f device] [-s WxH] [-t msecs] [-m MHz] [-S]"
+		" [converter...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int depths[] = { 15, 16, 24 };
+	/* the reference converters, by depth and chroma quality */
+	const CUBEConverterRec *conv, *ref[3][CUBE_CHROMA_DITHER + 1];
+	const char *device = NULL;
+	u32 msecs = 500;
+	double mhz = -1;
+	int d, i, opt, bad = 0;
+
+	memset(ref, 0, sizeof(ref));
+
+	while ((opt = getopt(argc, argv, "f:s:t:m:S")) != -1) {
+		switch (opt) {
+		case 'f':
+			device = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+				usage();
+			break;
+		case 't':
+			msecs = atoi(optarg);
+			break;
+		case 'm':
+			mhz = atof(optarg);
+			break;
+		case 'S':
+			convert_row = cube_convert_staged;
+			break;
+		default:
+			usage();
+		}
+	}
+	width &= ~1;
+	if (width < BENCH_BOX_W * 2 || height < BENCH_BOX_H * 2)
+		usage();
+	if (mhz < 0)
+		mhz = bench_mhz();
+
+	if (device) {
+		bench_map(device);
+	} else {
+		dst_pitch = width * 2;
+		dst = malloc(dst_pitch * height);
+	}
+	for (i = 0; i < WORKLOADS; i++)
+		src[i] = malloc(width * height * 4);
+	if (!dst || !src[WORKLOADS - 1]) {
+		fprintf(stderr, "cube_bench: out of memory\n");
+		return 1;
+	}
+
+	initRGB2YUVTables();
+	cube_convert_init(&ctx);
+
+	if (mhz > 0)
+		printf("%dx%d, MPixels/s and cycles/pixel at %.0f MHz\n",
+		       width, height, mhz);
+	else
+		printf("%dx%d, MPixels/s (give -m MHz for cycles/pixel)\n",
+		       width, height);
+	printf("%-10s %5s", "converter", "depth");
+	for (i = 0; i < WORKLOADS; i++)
+		printf("  %-14s", workload_names[i]);
+	printf("\n");
+
+	for (d = 0; d < 3; d++) {
+		bench_frames(depths[d]);
+		for (conv = CUBEConverters; conv->name; conv++) {
+			if (conv->depth != depths[d])
+				continue;
+			if (optind < argc) {
+				for (i = optind; i < argc && strcmp(argv[i], conv->name); i++)
+					;
+				if (i == argc)
+					continue;
+			}
+			if (conv->setup && !conv->setup()) {
+				fprintf(stderr, "cube_bench: %s unavailable\n", conv->name);
+				continue;
+			}
+			/* the reference is checked too, for its runs and row kernels */
+			if (!ref[d][conv->chroma])
+				ref[d][conv->chroma] = conv;
+			bad |= bench_check(conv, ref[d][conv->chroma]);
+			bench_run(conv, 1, msecs, mhz);
+			if (conv->rows)
+				bench_run(conv, 0, msecs, mhz);
+			/* the reference stays set up for the others to compare */
+			if (conv->release && conv != ref[d][conv->chroma])
+				conv->release();
+		}
+	}
+
+	return bad;
+}
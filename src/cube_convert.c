@@ -0,0 +1,911 @@
+/*
+   Gamecube/Wii framebuffer driver: the RGB to YUY2 conversion core.
+
+   The colour space tables and the span converters, kept free of any X
+   server dependency so that cube_bench can link them as they are and time
+   them away from the server, on the console or on a host.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "cube_convert.h"
+
+/**
+* This is the algorithm borrowed from libSDL port for gc-linux,
+* made by Albert "isobel" Herranz
+*
+* www.gc-linux.org
+*
+*/
+#define RGB2YUV_SHIFT   16
+#define RGB2YUV_LUMA    16
+#define RGB2YUV_CHROMA 128
+
+#define Yr ((int)( 0.299*(1<<RGB2YUV_SHIFT)))
+#define Yg ((int)( 0.587*(1<<RGB2YUV_SHIFT)))
+#define Yb ((int)( 0.114*(1<<RGB2YUV_SHIFT)))
+
+#define Ur ((int)(-0.169*(1<<RGB2YUV_SHIFT)))
+#define Ug ((int)(-0.331*(1<<RGB2YUV_SHIFT)))
+#define Ub ((int)( 0.500*(1<<RGB2YUV_SHIFT)))
+
+#define Vr ((int)( 0.500*(1<<RGB2YUV_SHIFT)))	/* same as Ub */
+#define Vg ((int)(-0.419*(1<<RGB2YUV_SHIFT)))
+#define Vb ((int)(-0.081*(1<<RGB2YUV_SHIFT)))
+
+#define clamp(x, y, z) ((z < x) ? x : ((z > y) ? y : z))
+
+static u32 r_Yr[256];
+static u32 g_Yg_[256];
+static u32 b_Yb[256];
+static u32 r_Ur[256];
+static u32 g_Ug_[256];
+static u32 b_Ub[256];
+/* static u32 r_Vr[256]; // space and cache optimisation */
+#define r_Vr b_Ub
+static u32 g_Vg_[256];
+static u32 b_Vb[256];
+
+static u8 RGB16toY[1 << 16];
+static u8 RGB16toU[1 << 16];
+static u8 RGB16toV[1 << 16];
+
+/* 565 components scaled to 8 bits */
+static u8 R5to8[32];
+static u8 G6to8[64];
+
+/*
+ * The tables only depend on the constants above, so they are built once per
+ * process; mode sets, VT switches and DPMS wakeups don't get to redo them.
+ */
+void initRGB2YUVTables(void)
+{
+	static int done = 0;
+	int i;
+	int r, g, b;
+
+	if (done)
+		return;
+	done = 1;
+
+	/* keep the divisions out of the 64k loop, there is no fast divide */
+	for (i = 0; i < 32; i++)
+		R5to8[i] = (i * 0xff) / 0x1f;
+	for (i = 0; i < 64; i++)
+		G6to8[i] = (i * 0xff) / 0x3f;
+
+	for (i = 0; i < 256; i++) {
+		r_Yr[i] = Yr * i;
+		g_Yg_[i] = Yg * i + (RGB2YUV_LUMA << RGB2YUV_SHIFT);
+		b_Yb[i] = Yb * i;
+		r_Ur[i] = Ur * i;
+		g_Ug_[i] = Ug * i + (RGB2YUV_CHROMA << RGB2YUV_SHIFT);
+		b_Ub[i] = Ub * i;
+		r_Vr[i] = Vr * i;
+		g_Vg_[i] = Vg * i + (RGB2YUV_CHROMA << RGB2YUV_SHIFT);
+		b_Vb[i] = Vb * i;
+	}
+
+	/* RGB565; RGB555 has the fixed format kernels below */
+	for (i = 0; i < 1 << 16; i++) {
+		r = ((i >> 11) & 0x1f);
+		g = ((i >> 5) & 0x3f);
+		b = ((i >> 0) & 0x1f);
+
+		/* scaling to 8 bits */
+		r = R5to8[r];
+		g = G6to8[g];
+		b = R5to8[b];
+
+		RGB16toY[i] =
+		    clamp(16, 235,
+			  (r_Yr[r] + g_Yg_[g] + b_Yb[b]) >> RGB2YUV_SHIFT);
+		RGB16toU[i] =
+		    clamp(16, 240,
+			  (r_Ur[r] + g_Ug_[g] + b_Ub[b]) >> RGB2YUV_SHIFT);
+		RGB16toV[i] =
+		    clamp(16, 240,
+			  (r_Vr[r] + g_Vg_[g] + b_Vb[b]) >> RGB2YUV_SHIFT);
+	}
+}
+
+
+
+static inline u32 rgbrgb16toyuy2(u16 rgb1, u16 rgb2)
+{
+	register int Y1, Cb, Y2, Cr;
+	u16 rgb;
+
+	/* fast path, thanks to bohdy */
+	if (!(rgb1 | rgb2)) {
+		return 0x00800080;	/* black, black */
+	}
+
+	if (rgb1 == rgb2) {
+		/* fast path, thanks to isobel */
+		Y1 = Y2 = RGB16toY[rgb1];
+		Cb = RGB16toU[rgb1];
+		Cr = RGB16toV[rgb1];
+	} else {
+		Y1 = RGB16toY[rgb1];
+		Y2 = RGB16toY[rgb2];
+
+		/*
+		 * This computes a new rgb using the mean of r,g,b between
+		 * rgb1 and rgb2. Tricky.
+		 * --isobel
+		 */
+		rgb = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
+		    + ((rgb1 & rgb2) & 0x0821);
+
+		Cb = RGB16toU[rgb];
+		Cr = RGB16toV[rgb];
+	}
+
+	return (((u8)Y1) << 24) | (((u8)Cb) << 16) | (((u8)Y2) << 8)
+	    | (((u8)Cr) << 0);
+}
+
+/*
+ * Same result as rgbrgb16toyuy2(), but with the black fast path done with a
+ * mask rather than a branch (the equal pixels one falls out of the mean
+ * anyway), so the lookups of several pairs can be scheduled together.
+ */
+static inline u32 rgbrgb16toyuy2_nobranch(u16 rgb1, u16 rgb2)
+{
+	u32 yuv, keep;
+	u16 rgb;
+
+	rgb = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
+	    + ((rgb1 & rgb2) & 0x0821);
+
+	yuv = (RGB16toY[rgb1] << 24) | (RGB16toU[rgb] << 16)
+	    | (RGB16toY[rgb2] << 8) | RGB16toV[rgb];
+
+	keep = -(u32)((rgb1 | rgb2) != 0);
+	return (yuv & keep) | (0x00800080 & ~keep);
+}
+
+/*
+ * Span converters. Each turns `pairs' RGB565 pixel pairs at src32 into as
+ * many YUY2 words at dst32; they all produce exactly the same output and only
+ * differ in how hard they lean on the caches and the bus. Which one wins
+ * depends on the machine, so CUBESelectConverter() times them at startup.
+ */
+
+/* the classic one, 192KiB of lookup tables */
+static void
+rgb16toyuy2_lut(u32 *dst32, const u32 *src32, int pairs,
+		const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2(rgb[0], rgb[1]);
+		rgb += 2;
+	}
+}
+
+/* no tables at all, for when the cache is better spent on pixels */
+#define RGB16_R8(rgb)	((((rgb) >> 11) & 0x1f) * 0xff / 0x1f)
+#define RGB16_G8(rgb)	((((rgb) >> 5) & 0x3f) * 0xff / 0x3f)
+#define RGB16_B8(rgb)	((((rgb) >> 0) & 0x1f) * 0xff / 0x1f)
+
+static inline int rgb16toy_arith(u16 rgb)
+{
+	int r = RGB16_R8(rgb), g = RGB16_G8(rgb), b = RGB16_B8(rgb);
+
+	return clamp(16, 235, (Yr * r + Yg * g + Yb * b +
+			       (RGB2YUV_LUMA << RGB2YUV_SHIFT)) >> RGB2YUV_SHIFT);
+}
+
+static inline u32 rgbrgb16toyuy2_arith(u16 rgb1, u16 rgb2)
+{
+	int r, g, b, Y1, Y2, Cb, Cr;
+	u16 rgb;
+
+	if (!(rgb1 | rgb2))
+		return 0x00800080;	/* black, black */
+
+	Y1 = rgb16toy_arith(rgb1);
+	Y2 = (rgb1 == rgb2) ? Y1 : rgb16toy_arith(rgb2);
+
+	rgb = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
+	    + ((rgb1 & rgb2) & 0x0821);
+	r = RGB16_R8(rgb);
+	g = RGB16_G8(rgb);
+	b = RGB16_B8(rgb);
+	Cb = clamp(16, 240, (Ur * r + Ug * g + Ub * b +
+			     (RGB2YUV_CHROMA << RGB2YUV_SHIFT)) >> RGB2YUV_SHIFT);
+	Cr = clamp(16, 240, (Vr * r + Vg * g + Vb * b +
+			     (RGB2YUV_CHROMA << RGB2YUV_SHIFT)) >> RGB2YUV_SHIFT);
+
+	return (Y1 << 24) | (Cb << 16) | (Y2 << 8) | Cr;
+}
+
+static void
+rgb16toyuy2_arith(u32 *dst32, const u32 *src32, int pairs,
+		  const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2_arith(rgb[0], rgb[1]);
+		rgb += 2;
+	}
+}
+
+/* four pairs per iteration, no branches inside */
+static void
+rgb16toyuy2_unrolled(u32 *dst32, const u32 *src32, int pairs,
+		     const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+	u32 w0, w1, w2, w3;
+
+	while (pairs >= 4) {
+		w0 = rgbrgb16toyuy2_nobranch(rgb[0], rgb[1]);
+		w1 = rgbrgb16toyuy2_nobranch(rgb[2], rgb[3]);
+		w2 = rgbrgb16toyuy2_nobranch(rgb[4], rgb[5]);
+		w3 = rgbrgb16toyuy2_nobranch(rgb[6], rgb[7]);
+		dst32[0] = w0;
+		dst32[1] = w1;
+		dst32[2] = w2;
+		dst32[3] = w3;
+		dst32 += 4;
+		rgb += 8;
+		pairs -= 4;
+	}
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2_nobranch(rgb[0], rgb[1]);
+		rgb += 2;
+	}
+}
+
+/*
+ * One 32-bit lookup per pixel instead of three byte lookups: each entry holds
+ * Y:U:Y:V for its colour, so a pair is the first pixel's Y, the mean's
+ * chroma and the second pixel's Y masked together. 256KiB, only allocated
+ * while somebody uses it.
+ */
+static u32 *RGB16toYUYV;
+static int RGB16toYUYVUsers;
+
+static int
+rgb16toyuy2_packed_setup(void)
+{
+	int i;
+
+	if (RGB16toYUYVUsers++)
+		return 1;
+
+	RGB16toYUYV = malloc((1 << 16) * sizeof(u32));
+	if (!RGB16toYUYV) {
+		RGB16toYUYVUsers = 0;
+		return 0;
+	}
+	for (i = 0; i < 1 << 16; i++)
+		RGB16toYUYV[i] = (RGB16toY[i] << 24) | (RGB16toU[i] << 16)
+		    | (RGB16toY[i] << 8) | RGB16toV[i];
+	return 1;
+}
+
+static void
+rgb16toyuy2_packed_release(void)
+{
+	if (--RGB16toYUYVUsers)
+		return;
+	free(RGB16toYUYV);
+	RGB16toYUYV = NULL;
+}
+
+static void
+rgb16toyuy2_packed(u32 *dst32, const u32 *src32, int pairs,
+		   const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+	const u32 *yuyv = RGB16toYUYV;
+	u16 rgb1, rgb2, mean;
+
+	while (pairs--) {
+		rgb1 = rgb[0];
+		rgb2 = rgb[1];
+		rgb += 2;
+
+		if (!(rgb1 | rgb2)) {
+			*dst32++ = 0x00800080;	/* black, black */
+		} else if (rgb1 == rgb2) {
+			*dst32++ = yuyv[rgb1];
+		} else {
+			mean = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
+			    + ((rgb1 & rgb2) & 0x0821);
+			*dst32++ = (yuyv[rgb1] & 0xff000000)
+			    | (yuyv[mean] & 0x00ff00ff)
+			    | (yuyv[rgb2] & 0x0000ff00);
+		}
+	}
+}
+
+/*
+ * The small footprint variant: the per-channel r_Yr/g_Yg_/... products again,
+ * but indexed by the raw 5/6/5 bit components (so the scaling to 8 bits is
+ * folded in) and with the Y, U and V terms of a component side by side. The
+ * lot is 1.5KiB and the sums are the very same as initRGB2YUVTables()'s.
+ */
+typedef struct {
+	u32 y, u, v;
+} CUBEYUVTerms;
+
+static CUBEYUVTerms R5toYUV[32];
+static CUBEYUVTerms G6toYUV[64];
+static CUBEYUVTerms B5toYUV[32];
+
+static int
+rgb16toyuy2_compact_setup(void)
+{
+	int i, c;
+
+	for (i = 0; i < 32; i++) {
+		c = (i * 0xff) / 0x1f;
+		R5toYUV[i].y = r_Yr[c];
+		R5toYUV[i].u = r_Ur[c];
+		R5toYUV[i].v = r_Vr[c];
+		B5toYUV[i].y = b_Yb[c];
+		B5toYUV[i].u = b_Ub[c];
+		B5toYUV[i].v = b_Vb[c];
+	}
+	for (i = 0; i < 64; i++) {
+		c = (i * 0xff) / 0x3f;
+		G6toYUV[i].y = g_Yg_[c];
+		G6toYUV[i].u = g_Ug_[c];
+		G6toYUV[i].v = g_Vg_[c];
+	}
+	return 1;
+}
+
+#define RGB16_TERMS(rgb, field) \
+	(R5toYUV[((rgb) >> 11) & 0x1f].field + G6toYUV[((rgb) >> 5) & 0x3f].field \
+	 + B5toYUV[(rgb) & 0x1f].field)
+
+static void
+rgb16toyuy2_compact(u32 *dst32, const u32 *src32, int pairs,
+		    const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+	u16 rgb1, rgb2, mean;
+	u32 Y1, Y2, Cb, Cr;
+
+	while (pairs--) {
+		rgb1 = rgb[0];
+		rgb2 = rgb[1];
+		rgb += 2;
+
+		if (!(rgb1 | rgb2)) {
+			*dst32++ = 0x00800080;	/* black, black */
+			continue;
+		}
+
+		Y1 = RGB16_TERMS(rgb1, y) >> RGB2YUV_SHIFT;
+		Y1 = clamp(16, 235, Y1);
+		if (rgb1 == rgb2) {
+			Y2 = Y1;
+			mean = rgb1;
+		} else {
+			Y2 = RGB16_TERMS(rgb2, y) >> RGB2YUV_SHIFT;
+			Y2 = clamp(16, 235, Y2);
+			mean = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
+			    + ((rgb1 & rgb2) & 0x0821);
+		}
+		Cb = RGB16_TERMS(mean, u) >> RGB2YUV_SHIFT;
+		Cb = clamp(16, 240, Cb);
+		Cr = RGB16_TERMS(mean, v) >> RGB2YUV_SHIFT;
+		Cr = clamp(16, 240, Cr);
+
+		*dst32++ = (Y1 << 24) | (Cb << 16) | (Y2 << 8) | Cr;
+	}
+}
+
+#ifdef CUBE_BROADWAY
+/*
+ * Gekko/Broadway: the unrolled converter, but the four words are gathered in
+ * a cached scratch line and leave through the FPU as two 64-bit stores, half
+ * the bus transactions of plain 32-bit stores into the uncached framebuffer.
+ */
+
+/* dst and line 8 byte aligned; lfd/stfd move the bits untouched */
+static inline void cube_store16(u32 *dst, const u32 *line)
+{
+	__asm__ __volatile__("lfd 0,0(%1)\n\t"
+			     "stfd 0,0(%0)\n\t"
+			     "lfd 0,8(%1)\n\t"
+			     "stfd 0,8(%0)"
+			     : : "b"(dst), "b"(line) : "fr0", "memory");
+}
+
+static void
+rgb16toyuy2_broadway(u32 *dst32, const u32 *src32, int pairs,
+		     const CUBEConvertCtx *ctx)
+{
+	u32 line[4] __attribute__ ((aligned(8)));
+	const u16 *rgb = (const u16 *) src32;
+
+	/* 64-bit stores want an 8 byte aligned destination */
+	if (pairs && ((unsigned long) dst32 & 4)) {
+		*dst32++ = rgbrgb16toyuy2(rgb[0], rgb[1]);
+		rgb += 2;
+		pairs--;
+	}
+
+	while (pairs >= 4) {
+		line[0] = rgbrgb16toyuy2_nobranch(rgb[0], rgb[1]);
+		line[1] = rgbrgb16toyuy2_nobranch(rgb[2], rgb[3]);
+		line[2] = rgbrgb16toyuy2_nobranch(rgb[4], rgb[5]);
+		line[3] = rgbrgb16toyuy2_nobranch(rgb[6], rgb[7]);
+		cube_store16(dst32, line);
+		dst32 += 4;
+		rgb += 8;
+		pairs -= 4;
+	}
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2(rgb[0], rgb[1]);
+		rgb += 2;
+	}
+}
+#endif /* CUBE_BROADWAY */
+
+/* Store n copies of a YUY2 word, for the runs in cube_convert_runs() */
+void
+cube_fill32(u32 *dst32, u32 yuv, int n)
+{
+#ifdef CUBE_BROADWAY
+	u32 line[4] __attribute__ ((aligned(8)));
+
+	if (n && ((unsigned long) dst32 & 4)) {
+		*dst32++ = yuv;
+		n--;
+	}
+	line[0] = line[1] = line[2] = line[3] = yuv;
+	for (; n >= 4; n -= 4, dst32 += 4)
+		cube_store16(dst32, line);
+#else
+	for (; n >= 4; n -= 4, dst32 += 4) {
+		dst32[0] = yuv;
+		dst32[1] = yuv;
+		dst32[2] = yuv;
+		dst32[3] = yuv;
+	}
+#endif
+	while (n--)
+		*dst32++ = yuv;
+}
+
+/*
+ * Depth 24: x8r8g8b8 pixel pairs, two words each, straight through the
+ * per-channel tables. Nothing is lost to 565 on the way, and the chroma of
+ * a pair comes from the mean of the two pixels as above.
+ */
+u32 rgbrgb32toyuy2(u32 rgb1, u32 rgb2)
+{
+	int r, g, b, Y1, Y2, Cb, Cr;
+	u32 rgb;
+
+	rgb1 &= 0xffffff;
+	rgb2 &= 0xffffff;
+	if (!(rgb1 | rgb2))
+		return 0x00800080;	/* black, black */
+
+	r = (rgb1 >> 16) & 0xff;
+	g = (rgb1 >> 8) & 0xff;
+	b = rgb1 & 0xff;
+	Y1 = (r_Yr[r] + g_Yg_[g] + b_Yb[b]) >> RGB2YUV_SHIFT;
+	Y1 = clamp(16, 235, Y1);
+
+	if (rgb1 == rgb2) {
+		Y2 = Y1;
+		rgb = rgb1;
+	} else {
+		r = (rgb2 >> 16) & 0xff;
+		g = (rgb2 >> 8) & 0xff;
+		b = rgb2 & 0xff;
+		Y2 = (r_Yr[r] + g_Yg_[g] + b_Yb[b]) >> RGB2YUV_SHIFT;
+		Y2 = clamp(16, 235, Y2);
+
+		/* per channel mean, same trick as for 565 */
+		rgb = (((rgb1 >> 1) & 0x7f7f7f) + ((rgb2 >> 1) & 0x7f7f7f))
+		    + ((rgb1 & rgb2) & 0x010101);
+	}
+
+	r = (rgb >> 16) & 0xff;
+	g = (rgb >> 8) & 0xff;
+	b = rgb & 0xff;
+	Cb = (r_Ur[r] + g_Ug_[g] + b_Ub[b]) >> RGB2YUV_SHIFT;
+	Cb = clamp(16, 240, Cb);
+	Cr = (r_Vr[r] + g_Vg_[g] + b_Vb[b]) >> RGB2YUV_SHIFT;
+	Cr = clamp(16, 240, Cr);
+
+	return (Y1 << 24) | (Cb << 16) | (Y2 << 8) | Cr;
+}
+
+static void
+rgb32toyuy2_channel(u32 *dst32, const u32 *src32, int pairs,
+		    const CUBEConvertCtx *ctx)
+{
+	while (pairs--) {
+		*dst32++ = rgbrgb32toyuy2(src32[0], src32[1]);
+		src32 += 2;
+	}
+}
+
+/*
+ * The fixed format kernels, see cube_kernel.h: one span converter per source
+ * format with its masks and shifts spelled out, and whole row kernels. The
+ * 16 bit formats look their pixels up in a packed table like "packed" does,
+ * RGB565 in that very one; RGB555 has a 128KiB one of its own.
+ */
+static u32 *RGB15toYUYV;
+static int RGB15toYUYVUsers;
+
+static int
+rgb555_setup(void)
+{
+	int i, r, g, b, Y, U, V;
+
+	if (RGB15toYUYVUsers++)
+		return 1;
+
+	RGB15toYUYV = malloc((1 << 15) * sizeof(u32));
+	if (!RGB15toYUYV) {
+		RGB15toYUYVUsers = 0;
+		return 0;
+	}
+	for (i = 0; i < 1 << 15; i++) {
+		r = R5to8[(i >> 10) & 0x1f];
+		g = R5to8[(i >> 5) & 0x1f];
+		b = R5to8[i & 0x1f];
+		Y = clamp(16, 235, (r_Yr[r] + g_Yg_[g] + b_Yb[b]) >> RGB2YUV_SHIFT);
+		U = clamp(16, 240, (r_Ur[r] + g_Ug_[g] + b_Ub[b]) >> RGB2YUV_SHIFT);
+		V = clamp(16, 240, (r_Vr[r] + g_Vg_[g] + b_Vb[b]) >> RGB2YUV_SHIFT);
+		RGB15toYUYV[i] = (Y << 24) | (U << 16) | (Y << 8) | V;
+	}
+	return 1;
+}
+
+static void
+rgb555_release(void)
+{
+	if (--RGB15toYUYVUsers)
+		return;
+	free(RGB15toYUYV);
+	RGB15toYUYV = NULL;
+}
+
+#define CUBE_PASTE2(a, b)	a##_##b
+#define CUBE_PASTE(a, b)	CUBE_PASTE2(a, b)
+
+#define CUBE_FMT		rgb565
+#define CUBE_FMT_T		u16
+#define CUBE_FMT_MASK		0xffff
+#define CUBE_FMT_YUYV(p)	RGB16toYUYV[p]
+#define CUBE_FMT_MEAN(a, b)	((((a) >> 1) & 0x7bef) + (((b) >> 1) & 0x7bef) \
+				 + ((a) & (b) & 0x0821))
+#include "cube_kernel.h"
+
+#define CUBE_FMT		rgb555
+#define CUBE_FMT_T		u16
+#define CUBE_FMT_MASK		0x7fff
+#define CUBE_FMT_YUYV(p)	RGB15toYUYV[p]
+#define CUBE_FMT_MEAN(a, b)	((((a) >> 1) & 0x3def) + (((b) >> 1) & 0x3def) \
+				 + ((a) & (b) & 0x0421))
+#include "cube_kernel.h"
+
+#define CUBE_FMT		xrgb8888
+#define CUBE_FMT_T		u32
+#define CUBE_FMT_MASK		0xffffff
+#define CUBE_FMT_R(p)		(((p) >> 16) & 0xff)
+#define CUBE_FMT_G(p)		(((p) >> 8) & 0xff)
+#define CUBE_FMT_B(p)		((p) & 0xff)
+#define CUBE_FMT_MEAN(a, b)	((((a) >> 1) & 0x7f7f7f) + (((b) >> 1) & 0x7f7f7f) \
+				 + ((a) & (b) & 0x010101))
+#include "cube_kernel.h"
+
+/*
+ * Better chroma, at both depths. The mean of a pixel pair above is taken in
+ * the shadow's own precision and the chroma then truncated, which at 565
+ * smears coloured text and bands gradients. Here the U and V of both pixels
+ * come from the per channel tables at 8 bits, and their sum is rounded - or,
+ * with ordered dithering, has a 4x4 Bayer threshold added - on the way down
+ * to 8 bits. Luma is the same as everywhere else.
+ *
+ * The dithering converters need to know where their output lands: the
+ * column from the destination address (the framebuffer and staging pitches
+ * are multiples of 16 bytes), the row from cube_dither_row().
+ */
+static const u8 cube_bayer4[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 }
+};
+
+void
+cube_dither_row(CUBEConvertCtx *ctx, int y)
+{
+	ctx->dither = cube_bayer4[y & 3];
+}
+
+/* what gets added to a sum of two chroma terms before the shift */
+#define CHROMA_ROUND		(1 << RGB2YUV_SHIFT)
+#define CHROMA_DITHER(t)	(((2 * (t) + 1) << (RGB2YUV_SHIFT + 1)) >> 5)
+#define CHROMA_PHASE(dst32)	(((unsigned long) (dst32) >> 2) & 3)
+
+static inline u32 rgbrgbtoyuy2_hq(int Y1, int Y2, int r1, int g1, int b1,
+				  int r2, int g2, int b2, u32 bias)
+{
+	int Cb, Cr;
+
+	Cb = (r_Ur[r1] + r_Ur[r2] + g_Ug_[g1] + g_Ug_[g2] + b_Ub[b1] + b_Ub[b2]
+	      + bias) >> (RGB2YUV_SHIFT + 1);
+	Cb = clamp(16, 240, Cb);
+	Cr = (r_Vr[r1] + r_Vr[r2] + g_Vg_[g1] + g_Vg_[g2] + b_Vb[b1] + b_Vb[b2]
+	      + bias) >> (RGB2YUV_SHIFT + 1);
+	Cr = clamp(16, 240, Cr);
+
+	return (Y1 << 24) | (Cb << 16) | (Y2 << 8) | Cr;
+}
+
+static inline u32 rgbrgb16toyuy2_hq(u16 rgb1, u16 rgb2, u32 bias)
+{
+	if (!(rgb1 | rgb2))
+		return 0x00800080;	/* black, black */
+
+	return rgbrgbtoyuy2_hq(RGB16toY[rgb1], RGB16toY[rgb2],
+			       R5to8[rgb1 >> 11], G6to8[(rgb1 >> 5) & 0x3f],
+			       R5to8[rgb1 & 0x1f],
+			       R5to8[rgb2 >> 11], G6to8[(rgb2 >> 5) & 0x3f],
+			       R5to8[rgb2 & 0x1f], bias);
+}
+
+static inline u32 rgbrgb32toyuy2_hq(u32 rgb1, u32 rgb2, u32 bias)
+{
+	int r1, g1, b1, r2, g2, b2, Y1, Y2;
+
+	rgb1 &= 0xffffff;
+	rgb2 &= 0xffffff;
+	if (!(rgb1 | rgb2))
+		return 0x00800080;	/* black, black */
+
+	r1 = (rgb1 >> 16) & 0xff;
+	g1 = (rgb1 >> 8) & 0xff;
+	b1 = rgb1 & 0xff;
+	r2 = (rgb2 >> 16) & 0xff;
+	g2 = (rgb2 >> 8) & 0xff;
+	b2 = rgb2 & 0xff;
+	Y1 = (r_Yr[r1] + g_Yg_[g1] + b_Yb[b1]) >> RGB2YUV_SHIFT;
+	Y2 = (r_Yr[r2] + g_Yg_[g2] + b_Yb[b2]) >> RGB2YUV_SHIFT;
+
+	return rgbrgbtoyuy2_hq(clamp(16, 235, Y1), clamp(16, 235, Y2),
+			       r1, g1, b1, r2, g2, b2, bias);
+}
+
+static void
+rgb16toyuy2_average(u32 *dst32, const u32 *src32, int pairs,
+		    const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2_hq(rgb[0], rgb[1], CHROMA_ROUND);
+		rgb += 2;
+	}
+}
+
+static void
+rgb16toyuy2_dither(u32 *dst32, const u32 *src32, int pairs,
+		   const CUBEConvertCtx *ctx)
+{
+	const u16 *rgb = (const u16 *) src32;
+	const u8 *t = ctx->dither;
+	int c = CHROMA_PHASE(dst32);
+
+	while (pairs--) {
+		*dst32++ = rgbrgb16toyuy2_hq(rgb[0], rgb[1], CHROMA_DITHER(t[c]));
+		c = (c + 1) & 3;
+		rgb += 2;
+	}
+}
+
+static void
+rgb32toyuy2_average(u32 *dst32, const u32 *src32, int pairs,
+		    const CUBEConvertCtx *ctx)
+{
+	while (pairs--) {
+		*dst32++ = rgbrgb32toyuy2_hq(src32[0], src32[1], CHROMA_ROUND);
+		src32 += 2;
+	}
+}
+
+static void
+rgb32toyuy2_dither(u32 *dst32, const u32 *src32, int pairs,
+		   const CUBEConvertCtx *ctx)
+{
+	const u8 *t = ctx->dither;
+	int c = CHROMA_PHASE(dst32);
+
+	while (pairs--) {
+		*dst32++ = rgbrgb32toyuy2_hq(src32[0], src32[1], CHROMA_DITHER(t[c]));
+		c = (c + 1) & 3;
+		src32 += 2;
+	}
+}
+
+const CUBEConverterRec CUBEConverters[] = {
+	{ "lut",	16, 16, rgb16toyuy2_lut,	NULL,	NULL },
+	{ "arith",	16, 16, rgb16toyuy2_arith,	NULL,	NULL },
+	{ "unrolled",	16, 16, rgb16toyuy2_unrolled, NULL,	NULL },
+	{ "packed",	16, 16, rgb16toyuy2_packed,
+	  rgb16toyuy2_packed_setup,	rgb16toyuy2_packed_release },
+	{ "compact",	16, 16, rgb16toyuy2_compact, rgb16toyuy2_compact_setup, NULL },
+#ifdef CUBE_BROADWAY
+	{ "broadway",	16, 16, rgb16toyuy2_broadway, NULL,	NULL },
+#endif
+	{ "fixed",	16, 16, rgb565_fixed,
+	  rgb16toyuy2_packed_setup,	rgb16toyuy2_packed_release,
+	  CUBE_CHROMA_FAST,	rgb565_rows },
+	{ "fixed",	15, 16, rgb555_fixed,	rgb555_setup,	rgb555_release,
+	  CUBE_CHROMA_FAST,	rgb555_rows },
+	{ "channel",	24, 32, rgb32toyuy2_channel, NULL,	NULL },
+	{ "fixed",	24, 32, xrgb8888_fixed,	NULL,	NULL,
+	  CUBE_CHROMA_FAST,	xrgb8888_rows },
+	{ "average",	16, 16, rgb16toyuy2_average, NULL, NULL, CUBE_CHROMA_AVERAGE },
+	{ "dither",	16, 16, rgb16toyuy2_dither,	NULL,	NULL,	CUBE_CHROMA_DITHER },
+	{ "average",	24, 32, rgb32toyuy2_average, NULL, NULL, CUBE_CHROMA_AVERAGE },
+	{ "dither",	24, 32, rgb32toyuy2_dither,	NULL,	NULL,	CUBE_CHROMA_DITHER },
+	{ NULL,		0,  0,  NULL,		NULL,	NULL }
+};
+
+void
+cube_convert_init(CUBEConvertCtx *ctx)
+{
+	cube_dither_row(ctx, 0);
+	ctx->rowConv = NULL;
+	ctx->row = NULL;
+	ctx->rowPairs = 0;
+}
+
+/* Chosen once per converter and mode, the flushes only compare pairs */
+void
+cube_convert_rows(CUBEConvertCtx *ctx, const CUBEConverterRec *conv, int pairs)
+{
+	const CUBERowKernelRec *k;
+
+	ctx->rowConv = conv;
+	ctx->row = NULL;
+	ctx->rowPairs = 0;
+	for (k = conv->rows; k && k->pairs; k++) {
+		if (k->pairs == pairs) {
+			ctx->row = k->convert;
+			ctx->rowPairs = pairs;
+		}
+	}
+}
+
+/*
+ * Backgrounds, terminals and UI fills are mostly long runs of one colour.
+ * Runs of identical source pairs are converted once and stored over with
+ * cube_fill32(); whatever lies between them goes through the converter, or
+ * a row with no runs in it through its row kernel, see cube_convert_rows().
+ * Not with the dithering converters, whose output isn't the same word twice.
+ * Returns how many of the pixels were in runs.
+ */
+int
+cube_convert_runs(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+		  u32 *dst32, const u32 *src32, int pairs)
+{
+	CUBEConvertProc convert = conv->convert;
+	int words = conv->bpp / 16;	/* source words per pair */
+	int i, j, start, run = 0;
+	u32 yuv;
+
+	/* carets, rules and the like: too narrow for a run */
+	if (pairs < CUBE_RUN_MIN || conv->chroma == CUBE_CHROMA_DITHER) {
+		convert(dst32, src32, pairs, ctx);
+		return 0;
+	}
+
+	for (i = start = 0; i < pairs; i = j) {
+		if (words == 1) {
+			for (j = i + 1; j < pairs && src32[j] == src32[i]; j++)
+				;
+		} else {
+			for (j = i + 1; j < pairs && src32[2 * j] == src32[2 * i] &&
+				    src32[2 * j + 1] == src32[2 * i + 1]; j++)
+				;
+		}
+		if (j - i < CUBE_RUN_MIN)
+			continue;
+
+		if (start < i)
+			convert(dst32 + start, src32 + start * words, i - start, ctx);
+		/* (into a local, reading the framebuffer back is slow) */
+		convert(&yuv, src32 + i * words, 1, ctx);
+		cube_fill32(dst32 + i, yuv, j - i);
+		run += (j - i) * 2;
+		start = j;
+	}
+	/* a whole row without runs, noise or video more often than not */
+	if (!start && pairs == ctx->rowPairs && conv == ctx->rowConv)
+		ctx->row(dst32, src32, pairs, ctx);
+	else if (start < pairs)
+		convert(dst32 + start, src32 + start * words, pairs - start, ctx);
+	return run;
+}
+
+/*
+ * The staged write strategy. Converters store a word at a time, which into
+ * the uncached framebuffer means a bus transaction per word. Here they
+ * convert into a cached staging line instead, which then goes out to the
+ * framebuffer as a stream of the widest stores there are: 64-bit FPU ones
+ * on Gekko/Broadway, where the staging line is also claimed with dcbz so
+ * the cache doesn't fetch what is about to be overwritten. (memcpy() is no
+ * good here, the PowerPC one uses dcbz on the destination, which faults on
+ * uncached memory.) The staging line is the context's, cache aligned within
+ * its stage[].
+ */
+
+/* dst and src at the same offset into a cache line */
+void
+cube_stream32(u32 *dst32, const u32 *src32, int n)
+{
+#ifdef CUBE_BROADWAY
+	if (n && ((unsigned long) dst32 & 4)) {
+		*dst32++ = *src32++;
+		n--;
+	}
+	for (; n >= 4; n -= 4, dst32 += 4, src32 += 4)
+		cube_store16(dst32, src32);
+#else
+	for (; n >= 4; n -= 4, dst32 += 4, src32 += 4) {
+		dst32[0] = src32[0];
+		dst32[1] = src32[1];
+		dst32[2] = src32[2];
+		dst32[3] = src32[3];
+	}
+#endif
+	while (n--)
+		*dst32++ = *src32++;
+}
+
+int
+cube_convert_staged(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+		    u32 *dst32, const u32 *src32, int pairs)
+{
+	int words = conv->bpp / 16;	/* source words per pair */
+	int offset = ((unsigned long) dst32 & (CUBE_LINE - 1)) / 4;
+	u32 *base = (u32 *) (((unsigned long) ctx->stage + CUBE_LINE - 1) &
+			     ~(CUBE_LINE - 1UL));
+	u32 *stage = base + offset;
+	int n, run = 0;
+#ifdef CUBE_BROADWAY
+	u8 *line;
+#endif
+
+	while (pairs) {
+		n = pairs < CUBE_STAGE_PAIRS ? pairs : CUBE_STAGE_PAIRS;
+#ifdef CUBE_BROADWAY
+		for (line = (u8 *) base; line < (u8 *) (stage + n); line += CUBE_LINE)
+			__asm__ __volatile__("dcbz 0,%0" : : "r"(line) : "memory");
+#endif
+		run += cube_convert_runs(ctx, conv, stage, src32, n);
+		cube_stream32(dst32, stage, n);
+		dst32 += n;
+		src32 += n * words;
+		pairs -= n;
+	}
+	return run;
+}
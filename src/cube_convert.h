@@ -0,0 +1,104 @@
+/*
+   Gamecube/Wii framebuffer driver: the RGB to YUY2 conversion core, shared
+   by the driver and cube_bench. Nothing in here knows about the X server.
+
+   YUY2 words hold Y1:U:Y2:V from the most significant byte down and are
+   stored as native words, which is what the framebuffer wants on the (big
+   endian) console.
+*/
+
+#ifndef CUBE_CONVERT_H
+#define CUBE_CONVERT_H
+
+#include <stdint.h>
+
+typedef int8_t             s8;
+typedef uint8_t            u8;
+typedef int16_t            s16;
+typedef uint16_t           u16;
+typedef int32_t            s32;
+typedef uint32_t           u32;
+
+#define CUBE_STAGE_PAIRS 128	/* words staged at a time, see cube_convert.c */
+#define CUBE_LINE	32	/* bytes, the cache line and burst size */
+
+typedef struct _CUBEConvertCtx CUBEConvertCtx;
+struct _CUBEConverterRec;
+
+/* A RGB565, RGB555 or x8r8g8b8 to YUY2 span converter, see CUBEConverters[] */
+typedef void (*CUBEConvertProc)(u32 *dst32, const u32 *src32, int pairs,
+				const CUBEConvertCtx *ctx);
+
+/*
+ * What converting needs besides the pixels: the staging line, the dither
+ * row and the whole row kernel. One per screen, so that screens flushing in
+ * threads of their own share nothing but read-only tables; set up with
+ * cube_convert_init().
+ */
+struct _CUBEConvertCtx {
+  u32                 stage[CUBE_STAGE_PAIRS + 2 * CUBE_LINE / 4]; /* aligned within */
+  const u8*           dither;     /* thresholds for the row, cube_dither_row() */
+  /* cube_convert_rows(): the kernel rows of rowPairs pairs of rowConv take */
+  const struct _CUBEConverterRec *rowConv;
+  CUBEConvertProc     row;
+  int                 rowPairs;
+};
+
+/* A converter's kernel for rows of exactly `pairs' pairs */
+typedef struct {
+  int                 pairs;      /* 0 ends the list */
+  CUBEConvertProc     convert;
+} CUBERowKernelRec;
+
+/* what the chroma of a pixel pair is made of */
+#define CUBE_CHROMA_FAST	0	/* the pair's mean, at the shadow's depth */
+#define CUBE_CHROMA_AVERAGE	1	/* both pixels' at 8 bits, rounded */
+#define CUBE_CHROMA_DITHER	2	/* the same, ordered dithered */
+
+typedef struct _CUBEConverterRec {
+  const char*         name;
+  int                 depth;      /* 16, 15 or 24 */
+  int                 bpp;        /* of the shadow pixels it reads */
+  CUBEConvertProc     convert;
+  int                 (*setup)(void);   /* build private tables, or NULL */
+  void                (*release)(void);
+  int                 chroma;     /* CUBE_CHROMA_*; those alike agree */
+  const CUBERowKernelRec *rows;   /* or NULL */
+} CUBEConverterRec, *CUBEConverterPtr;
+
+/* every converter built in, up to one with a NULL name */
+extern const CUBEConverterRec CUBEConverters[];
+
+#define CUBE_RUN_MIN 8	/* pairs, shorter runs stay with the converter */
+
+/* once per process, before any converter is used */
+void initRGB2YUVTables(void);
+
+void cube_convert_init(CUBEConvertCtx *ctx);
+
+/* have cube_convert_runs() use conv's kernel for rows of `pairs' pairs,
+   if it has one */
+void cube_convert_rows(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+		       int pairs);
+
+/* store n copies of yuv, with the widest stores there are */
+void cube_fill32(u32 *dst32, u32 yuv, int n);
+
+/* the row the next CUBE_CHROMA_DITHER spans are for */
+void cube_dither_row(CUBEConvertCtx *ctx, int y);
+
+/* one x8r8g8b8 pixel pair */
+u32 rgbrgb32toyuy2(u32 rgb1, u32 rgb2);
+
+int cube_convert_runs(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+		      u32 *dst32, const u32 *src32, int pairs);
+
+/* the same through a cached staging line, see cube_convert.c */
+int cube_convert_staged(CUBEConvertCtx *ctx, const CUBEConverterRec *conv,
+			u32 *dst32, const u32 *src32, int pairs);
+
+/* copy n words out to the framebuffer, dst and src at the same offset
+   into a cache line */
+void cube_stream32(u32 *dst32, const u32 *src32, int n);
+
+#endif /* CUBE_CONVERT_H */
@@ -0,0 +1,479 @@
+/*
+   Gamecube/Wii framebuffer driver: the damage accumulator and the walk a
+   flush makes over it, kept free of any X server dependency so that
+   cube_replay can play captured traces through them as they are.
+
+   Boxes are folded into a small sorted set of disjoint, pair aligned spans
+   per row, so every dirty pixel is converted once per flush no matter how
+   many boxes covered it. Spans closer than SpanCost pixels are merged, as
+   converting the gap is cheaper than setting up another span, and where the
+   framebuffer lines allow it spans of a burst or more are widened to whole
+   write gather bursts. Narrower ones, carets and rules, stay exactly the
+   pairs they touch. Text makes for lots of little boxes side by side; they
+   end up as one span a row, whatever order they came in.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cube_damage.h"
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+int
+CUBEDamageInit(CUBEDamagePtr pDamage, int width, int height, int tiles)
+{
+  pDamage->width = width;
+  pDamage->height = height;
+  pDamage->align = 2;
+  pDamage->gap = 0;
+  pDamage->y1 = height;
+  pDamage->y2 = 0;
+  pDamage->nspans = calloc(height, sizeof(u8));
+  pDamage->spans = calloc(height * CUBE_MAX_SPANS, sizeof(CUBESpanRec));
+  pDamage->rowHash = calloc(height, sizeof(u32));
+  pDamage->hashValid = calloc(height, sizeof(u8));
+  pDamage->prev = calloc(height, sizeof(CUBESpanRec));
+  pDamage->py1 = height;
+  pDamage->py2 = 0;
+  if (!pDamage->nspans || !pDamage->spans ||
+      !pDamage->rowHash || !pDamage->hashValid || !pDamage->prev) {
+    CUBEDamageFree(pDamage);
+    return 0;
+  }
+
+  pDamage->tilesX = (width + CUBE_TILE - 1) / CUBE_TILE;
+  pDamage->tilesY = (height + CUBE_TILE - 1) / CUBE_TILE;
+  pDamage->bands = calloc(pDamage->tilesY, sizeof(CUBEBandRec));
+  pDamage->order = calloc(pDamage->tilesY, sizeof(u16));
+  if (!pDamage->bands || !pDamage->order) {
+    CUBEDamageFree(pDamage);
+    return 0;
+  }
+  if (tiles) {
+    pDamage->tileHash = calloc(pDamage->tilesX * pDamage->tilesY, sizeof(u32));
+    pDamage->tileValid = calloc(pDamage->tilesX * pDamage->tilesY, sizeof(u8));
+    pDamage->tileDirty = calloc(pDamage->tilesX, sizeof(u8));
+    if (!pDamage->tileHash || !pDamage->tileValid || !pDamage->tileDirty) {
+      CUBEDamageFree(pDamage);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void
+CUBEDamageFree(CUBEDamagePtr pDamage)
+{
+  free(pDamage->nspans);
+  free(pDamage->spans);
+  free(pDamage->rowHash);
+  free(pDamage->hashValid);
+  free(pDamage->prev);
+  free(pDamage->tileHash);
+  free(pDamage->tileValid);
+  free(pDamage->tileDirty);
+  free(pDamage->bands);
+  free(pDamage->order);
+  pDamage->nspans = NULL;
+  pDamage->spans = NULL;
+  pDamage->rowHash = NULL;
+  pDamage->hashValid = NULL;
+  pDamage->prev = NULL;
+  pDamage->tileHash = NULL;
+  pDamage->tileValid = NULL;
+  pDamage->tileDirty = NULL;
+  pDamage->bands = NULL;
+  pDamage->order = NULL;
+}
+
+/* The framebuffer no longer shows what we last converted, forget the hashes */
+void
+CUBEDamageInvalidate(CUBEDamagePtr pDamage)
+{
+  if (pDamage->hashValid)
+    memset(pDamage->hashValid, 0, pDamage->height);
+  if (pDamage->tileValid)
+    memset(pDamage->tileValid, 0, pDamage->tilesX * pDamage->tilesY);
+  /* whoever cleared the screen cleared both pages */
+  if (pDamage->prev)
+    memset(pDamage->prev, 0, pDamage->height * sizeof(CUBESpanRec));
+  pDamage->py1 = pDamage->height;
+  pDamage->py2 = 0;
+}
+
+/* Rows [y1, y2) were drawn behind our back, don't trust their hashes */
+void
+CUBEDamageForget(CUBEDamagePtr pDamage, int y1, int y2)
+{
+  y1 = MAX(y1, 0);
+  y2 = MIN(y2, pDamage->height);
+  if (pDamage->hashValid && y1 < y2)
+    memset(pDamage->hashValid + y1, 0, y2 - y1);
+  if (pDamage->tileValid && y1 < y2)
+    memset(pDamage->tileValid + (y1 / CUBE_TILE) * pDamage->tilesX, 0,
+           ((y2 - 1) / CUBE_TILE - y1 / CUBE_TILE + 1) * pDamage->tilesX);
+}
+
+static void
+CUBEDamageAddSpan(CUBEDamagePtr pDamage, int y, int x1, int x2)
+{
+  CUBESpanPtr spans = pDamage->spans + y * CUBE_MAX_SPANS;
+  CUBESpanRec tmp[CUBE_MAX_SPANS + 1];
+  int n = pDamage->nspans[y];
+  int i, j, best;
+
+  /* skip the spans lying fully to the left, further than gap */
+  for (i = 0; i < n && spans[i].x2 + pDamage->gap < x1; i++)
+    ;
+
+  /* swallow every span overlapping the new one or closer than that */
+  for (j = i; j < n && spans[j].x1 <= x2 + pDamage->gap; j++) {
+    x1 = MIN(x1, spans[j].x1);
+    x2 = MAX(x2, spans[j].x2);
+  }
+
+  if (j == i && n == CUBE_MAX_SPANS) {
+    /* no room: insert anyway, then merge the two closest spans */
+    memcpy(tmp, spans, i * sizeof(CUBESpanRec));
+    tmp[i].x1 = x1;
+    tmp[i].x2 = x2;
+    memcpy(tmp + i + 1, spans + i, (n - i) * sizeof(CUBESpanRec));
+    best = 0;
+    for (j = 1; j < n; j++)
+      if (tmp[j + 1].x1 - tmp[j].x2 < tmp[best + 1].x1 - tmp[best].x2)
+        best = j;
+    tmp[best].x2 = tmp[best + 1].x2;
+    memcpy(spans, tmp, (best + 1) * sizeof(CUBESpanRec));
+    memcpy(spans + best + 1, tmp + best + 2,
+           (n - best - 1) * sizeof(CUBESpanRec));
+    return;
+  }
+
+  /* replace spans [i, j) by the new one */
+  memmove(spans + i + 1, spans + j, (n - j) * sizeof(CUBESpanRec));
+  spans[i].x1 = x1;
+  spans[i].x2 = x2;
+  pDamage->nspans[y] = n - (j - i) + 1;
+}
+
+void
+CUBEDamageAdd(CUBEDamagePtr pDamage, int x1, int y1, int x2, int y2)
+{
+  int y;
+
+  x1 = MAX(x1, 0);
+  y1 = MAX(y1, 0);
+  x2 = MIN(x2, pDamage->width);
+  y2 = MIN(y2, pDamage->height);
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  /* YUY2 shares chroma between pixel pairs, work in whole pairs */
+  x1 &= ~1;
+  x2 = (x2 + 1) & ~1;
+  /* and in whole bursts, unless that would mean converting mostly others */
+  if (x2 - x1 >= pDamage->align) {
+    x1 &= ~(pDamage->align - 1);
+    x2 = MIN((x2 + pDamage->align - 1) & ~(pDamage->align - 1), pDamage->width);
+  }
+
+  for (y = y1; y < y2; y++)
+    CUBEDamageAddSpan(pDamage, y, x1, x2);
+
+  pDamage->y1 = MIN(pDamage->y1, y1);
+  pDamage->y2 = MAX(pDamage->y2, y2);
+}
+
+void
+CUBEDamageClear(CUBEDamagePtr pDamage)
+{
+  int y;
+
+  for (y = pDamage->y1; y < pDamage->y2; y++)
+    pDamage->nspans[y] = 0;
+  pDamage->y1 = pDamage->height;
+  pDamage->y2 = 0;
+}
+
+/* FNV-1a, one 32-bit word at a time, carrying on from h */
+#define CUBE_HASH_INIT 0x811c9dc5
+
+static u32
+CUBEHash(u32 h, const u32 *src, int words)
+{
+  while (words--)
+    h = (h ^ *src++) * 0x01000193;
+  return h;
+}
+
+/*
+ * TileCache: of the tiles in the band of rows holding y, find those which
+ * have damage and really changed since they were last converted. The rest
+ * are left out of the band's conversion by CUBEDamageSpan(). As with rows,
+ * a tile with only a few damaged pixels, say a caret, is cheaper to convert
+ * than to hash; it is converted and its hash dropped.
+ */
+static void
+CUBETileScan(CUBEDamagePtr pDamage, CUBEFlushPtr pFlush, int y)
+{
+  u8 *dirty = pDamage->tileDirty;
+  int bpp = pFlush->bpp;
+  int y1 = y - y % CUBE_TILE, y2 = MIN(y1 + CUBE_TILE, pDamage->height);
+  int row, i, tx, x, w, tile, n;
+  CUBESpanPtr spans;
+  u32 hash;
+
+  /* damaged pixels per tile, up to 255 */
+  memset(dirty, 0, pDamage->tilesX);
+  for (row = y1; row < y2; row++) {
+    spans = pDamage->spans + row * CUBE_MAX_SPANS;
+    for (i = 0; i < pDamage->nspans[row]; i++) {
+      for (tx = spans[i].x1 / CUBE_TILE; tx * CUBE_TILE < spans[i].x2; tx++) {
+        n = MIN(spans[i].x2, (tx + 1) * CUBE_TILE) - MAX(spans[i].x1, tx * CUBE_TILE);
+        dirty[tx] = MIN(dirty[tx] + n, 255);
+      }
+    }
+  }
+
+  for (tx = 0; tx < pDamage->tilesX; tx++) {
+    if (!dirty[tx])
+      continue;
+    tile = (y1 / CUBE_TILE) * pDamage->tilesX + tx;
+    if (dirty[tx] * 8 < CUBE_TILE * CUBE_TILE) {
+      pDamage->tileValid[tile] = 0;
+      continue;
+    }
+    x = tx * CUBE_TILE;
+    w = MIN(CUBE_TILE, pDamage->width - x);
+    hash = CUBE_HASH_INIT;
+    for (row = y1; row < y2; row++)
+      hash = CUBEHash(hash, (const u32 *) (pFlush->shadow + row * pFlush->pitch
+                                           + x * bpp), w * bpp / 4);
+    dirty[tx] = !pDamage->tileValid[tile] || pDamage->tileHash[tile] != hash;
+    pFlush->tilesSame += !dirty[tx];
+    pDamage->tileHash[tile] = hash;
+    pDamage->tileValid[tile] = 1;
+  }
+}
+
+/* Hand over [x1, x2) of row y to be converted; with TileCache only where the tiles changed */
+static void
+CUBEDamageSpan(CUBEDamagePtr pDamage, CUBEFlushPtr pFlush, int y, int x1, int x2)
+{
+  const u8 *dirty = pDamage->tileDirty;
+  int x;
+
+  if (!dirty) {
+    pFlush->convert(pFlush->arg, y, x1, x2);
+    return;
+  }
+
+  while (x1 < x2) {
+    /* skip the unchanged tiles, then take the changed ones in one go */
+    while (x1 < x2 && !dirty[x1 / CUBE_TILE])
+      x1 = (x1 / CUBE_TILE + 1) * CUBE_TILE;
+    for (x = x1; x < x2 && dirty[x / CUBE_TILE]; )
+      x = (x / CUBE_TILE + 1) * CUBE_TILE;
+    x = MIN(x, x2);
+    if (x1 < x)
+      pFlush->convert(pFlush->arg, y, x1, x);
+    x1 = x;
+  }
+}
+
+/* FrameBudget: the order bands are served in, see CUBEDamagePlan() */
+static int
+CUBEBandBefore(const CUBEBandRec *a, const CUBEBandRec *b)
+{
+  if (a->near != b->near)
+    return a->near;
+  if (a->age != b->age)
+    return a->age > b->age;
+  return a->dirty < b->dirty;
+}
+
+/*
+ * FrameBudget: which bands of CUBE_TILE rows the flush about to start
+ * converts, when all of the damage won't fit in budget ticks going by what
+ * the last flushes cost a pixel. Bands near the pointer go first, then the
+ * bands which waited longest, then the smallest, which more often than not
+ * is typing. What doesn't fit waits for the next frame, but never for more
+ * than CUBE_MAX_AGE of them. Returns whether some damage is left out.
+ */
+static int
+CUBEDamagePlan(CUBEDamagePtr pDamage, CUBEFlushPtr pFlush, u32 budget)
+{
+  CUBEBandPtr b;
+  CUBESpanPtr spans;
+  unsigned long long total = 0, cost, spent = 0;
+  int band, n = 0, i, k, y, y2, fits, left = 0;
+
+  if (!pFlush->pixelCost || pDamage->y1 >= pDamage->y2)
+    return 0;
+
+  for (band = pDamage->y1 / CUBE_TILE; band * CUBE_TILE < pDamage->y2; band++) {
+    b = &pDamage->bands[band];
+    b->dirty = 0;
+    b->near = 0;
+    b->pick = 1;
+    y2 = MIN((band + 1) * CUBE_TILE, pDamage->height);
+    for (y = band * CUBE_TILE; y < y2; y++) {
+      spans = pDamage->spans + y * CUBE_MAX_SPANS;
+      for (i = 0; i < pDamage->nspans[y]; i++) {
+        b->dirty += spans[i].x2 - spans[i].x1;
+        if (y >= pFlush->nearY1 && y < pFlush->nearY2 &&
+            spans[i].x1 < pFlush->nearX2 && spans[i].x2 > pFlush->nearX1)
+          b->near = 1;
+      }
+    }
+    if (!b->dirty) {
+      b->age = 0;
+      continue;
+    }
+    total += b->dirty;
+
+    /* there are a few dozen bands at most */
+    for (k = n++; k > 0 &&
+         CUBEBandBefore(b, &pDamage->bands[pDamage->order[k - 1]]); k--)
+      pDamage->order[k] = pDamage->order[k - 1];
+    pDamage->order[k] = band;
+  }
+
+  fits = (total * pFlush->pixelCost >> 16) <= budget;
+  for (k = 0; k < n; k++) {
+    b = &pDamage->bands[pDamage->order[k]];
+    cost = (unsigned long long) b->dirty * pFlush->pixelCost >> 16;
+    b->pick = fits || k == 0 || b->age >= CUBE_MAX_AGE || spent + cost <= budget;
+    if (b->pick) {
+      spent += cost;
+      b->age = 0;
+    } else {
+      b->age++;
+      pFlush->carried++;
+      left = 1;
+    }
+  }
+  return left;
+}
+
+/*
+ * Hand over everything accumulated so far, or with a budget what
+ * CUBEDamagePlan() picks, the rest staying for later. Rows which hash the
+ * same as when we last converted them are left alone; hashing a whole row
+ * only pays off when a fair part of it is dirty, so narrow damage is
+ * converted unconditionally and merely drops the row's hash.
+ *
+ * When page flipping (pFlush->copy) we draw into the back page, which lacks
+ * whatever the previous flush drew into the other one; that much is copied
+ * forward first, unless it is about to be converted again anyway.
+ */
+void
+CUBEDamageWalk(CUBEDamagePtr pDamage, CUBEFlushPtr pFlush, u32 budget)
+{
+  int flipping = pFlush->copy != NULL;
+  CUBESpanPtr spans, prev;
+  const u8 *src;
+  u32 hash;
+  int y, y1, y2, i, n, dirty, ky1, ky2, convert, planned = 0;
+
+  if (budget)
+    planned = CUBEDamagePlan(pDamage, pFlush, budget);
+  ky1 = pDamage->height;	/* rows whose damage stays */
+  ky2 = 0;
+
+  y1 = pDamage->y1;
+  y2 = pDamage->y2;
+  if (flipping) {
+    y1 = MIN(y1, pDamage->py1);
+    y2 = MAX(y2, pDamage->py2);
+    pDamage->py1 = pDamage->height;
+    pDamage->py2 = 0;
+  }
+
+  for (y = y1; y < y2; y++) {
+    if (planned && !pDamage->bands[y / CUBE_TILE].pick) {
+      if (pDamage->nspans[y]) {
+        ky1 = MIN(ky1, y);
+        ky2 = y + 1;
+      }
+      n = 0;
+    } else {
+      if (pDamage->tileDirty && (y == y1 || y % CUBE_TILE == 0))
+        CUBETileScan(pDamage, pFlush, y);
+      n = pDamage->nspans[y];
+      pDamage->nspans[y] = 0;
+    }
+    spans = pDamage->spans + y * CUBE_MAX_SPANS;
+    src = pFlush->shadow + y * pFlush->pitch;
+
+    convert = 0;
+    if (n) {
+      dirty = 0;
+      for (i = 0; i < n; i++)
+        dirty += spans[i].x2 - spans[i].x1;
+
+      if (dirty * 8 >= pDamage->width) {
+        hash = CUBEHash(CUBE_HASH_INIT, (const u32 *) src,
+                        pDamage->width * pFlush->bpp / 4);
+        convert = !pDamage->hashValid[y] || pDamage->rowHash[y] != hash;
+        pFlush->rowsSame += !convert;
+        pDamage->rowHash[y] = hash;
+        pDamage->hashValid[y] = 1;
+      } else {
+        convert = 1;
+        pDamage->hashValid[y] = 0;
+      }
+    }
+
+    if (flipping) {
+      prev = pDamage->prev + y;
+      if (prev->x1 < prev->x2) {
+        for (i = 0; convert && i < n; i++)
+          if (spans[i].x1 <= prev->x1 && spans[i].x2 >= prev->x2)
+            break;
+        /* with TileCache, even a covering span may skip some of it */
+        if (!convert || i == n || pDamage->tileDirty)
+          pFlush->copy(pFlush->arg, y, prev->x1, prev->x2);
+        prev->x1 = prev->x2 = 0;
+      }
+      if (convert) {
+        prev->x1 = spans[0].x1;
+        prev->x2 = spans[n - 1].x2;
+        pDamage->py1 = MIN(pDamage->py1, y);
+        pDamage->py2 = y + 1;
+      }
+    }
+
+    if (!convert)
+      continue;
+
+    pFlush->rows++;
+    for (i = 0; i < n; i++)
+      CUBEDamageSpan(pDamage, pFlush, y, spans[i].x1, spans[i].x2);
+  }
+
+  pDamage->y1 = ky1;
+  pDamage->y2 = ky2;
+}
+
+/*
+ * FrameBudget: a flush's cost, ticks for pixels converted, folded into the
+ * running average of what a pixel costs, in ticks per 64Ki pixels. Flushes
+ * too small to tell leave it be.
+ */
+u32
+CUBEDamageCost(u32 pixelCost, u32 ticks, unsigned long long pixels)
+{
+  u32 cost;
+
+  if (pixels < CUBE_TILE * CUBE_TILE)
+    return pixelCost;
+  cost = ((unsigned long long) ticks << 16) / pixels;
+  return pixelCost ? (pixelCost * 3 + cost) / 4 : cost;
+}
@@ -0,0 +1,88 @@
+/*
+   Gamecube/Wii framebuffer driver: the damage accumulator, and what a flush
+   makes of it, shared by the driver and cube_replay. Nothing in here knows
+   about the X server.
+
+   Damage is folded into a small sorted set of disjoint, pair aligned spans
+   per row, see CUBEDamageAdd(). A flush walks the rows, see CUBEDamageWalk():
+   it leaves alone the rows (and with TileCache the tiles) that hash the same
+   as when they were last converted, and with a FrameBudget leaves for later
+   the bands that don't fit. What is left it hands back, span by span, to be
+   converted.
+*/
+
+#ifndef CUBE_DAMAGE_H
+#define CUBE_DAMAGE_H
+
+#include "cube_convert.h"
+
+#define CUBE_MAX_SPANS 4	/* spans kept per row before merging the closest */
+#define CUBE_TILE      16	/* TileCache tiles are CUBE_TILE pixels square */
+#define CUBE_BURST     32	/* bytes the write gather pipe sends out at once */
+#define CUBE_SPAN_COST 16	/* default SpanCost, in pixels */
+#define CUBE_MAX_AGE 6		/* frames FrameBudget lets damage wait, at most */
+
+typedef struct {
+  s16                 x1, x2;     /* [x1, x2) in pixels, both even */
+} CUBESpanRec, *CUBESpanPtr;
+
+typedef struct {
+  u32                 dirty;      /* damaged pixels */
+  u8                  age;        /* frames the damage has waited */
+  u8                  pick;       /* converted by this flush */
+  u8                  near;       /* by the pointer */
+} CUBEBandRec, *CUBEBandPtr;
+
+typedef struct {
+  int                 width, height;
+  int                 align;      /* spans start and end on multiples of it */
+  int                 gap;        /* pixels between spans not worth keeping */
+  int                 y1, y2;     /* rows [y1, y2) may hold spans */
+  u8*                 nspans;     /* spans in use per row */
+  CUBESpanPtr         spans;      /* CUBE_MAX_SPANS per row */
+  u32*                rowHash;    /* shadow row hash at last conversion */
+  u8*                 hashValid;  /* rowHash matches what is on screen */
+  /* DoubleBuffer: what the last flush drew, to be copied to the other page */
+  int                 py1, py2;
+  CUBESpanPtr         prev;       /* one covering span per row */
+  /* TileCache: the same as rowHash/hashValid, per tile */
+  int                 tilesX, tilesY;
+  u32*                tileHash;
+  u8*                 tileValid;
+  u8*                 tileDirty;  /* tiles of the band being flushed that changed */
+  /* FrameBudget: the same bands of CUBE_TILE rows */
+  CUBEBandPtr         bands;
+  u16*                order;      /* damaged bands, most urgent first */
+} CUBEDamageRec, *CUBEDamagePtr;
+
+/*
+ * A flush, as its owner sets it up for CUBEDamageWalk(): where the shadow
+ * is, what to do with the spans, and for FrameBudget what a pixel costs and
+ * where the pointer is. The walk counts what it did in the rest.
+ */
+typedef struct {
+  const u8*           shadow;
+  u32                 pitch;      /* bytes per shadow row */
+  int                 bpp;        /* bytes per shadow pixel, 2 or 4 */
+  /* convert [x1, x2) of row y; copy it from the front page when flipping */
+  void                (*convert)(void *arg, int y, int x1, int x2);
+  void                (*copy)(void *arg, int y, int x1, int x2);  /* or NULL */
+  void*               arg;
+  u32                 pixelCost;  /* ticks per 64Ki pixels, 0 if unknown */
+  int                 nearX1, nearY1, nearX2, nearY2;  /* first, if wanted */
+  u32                 rows;       /* rows converted... */
+  u32                 rowsSame;   /* ...and left alone, their hash unchanged */
+  u32                 tilesSame;  /* TileCache: damaged tiles left alone */
+  u32                 carried;    /* FrameBudget: bands left for later */
+} CUBEFlushRec, *CUBEFlushPtr;
+
+int  CUBEDamageInit(CUBEDamagePtr pDamage, int width, int height, int tiles);
+void CUBEDamageFree(CUBEDamagePtr pDamage);
+void CUBEDamageInvalidate(CUBEDamagePtr pDamage);
+void CUBEDamageForget(CUBEDamagePtr pDamage, int y1, int y2);
+void CUBEDamageAdd(CUBEDamagePtr pDamage, int x1, int y1, int x2, int y2);
+void CUBEDamageClear(CUBEDamagePtr pDamage);
+void CUBEDamageWalk(CUBEDamagePtr pDamage, CUBEFlushPtr pFlush, u32 budget);
+u32  CUBEDamageCost(u32 pixelCost, u32 ticks, unsigned long long pixels);
+
+#endif /* CUBE_DAMAGE_H */
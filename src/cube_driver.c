@@ -39,8 +39,16 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/vfs.h>
 //#include <asm/page.h>
 #include <linux/fb.h>
+#ifdef CUBE_THREADS
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+#include <signal.h>
 #include "xaa.h"
 #include "xf86Cursor.h"
 #include "colormapst.h"
@@ -57,6 +65,21 @@
 #include "fb.h"
 #include "xf86cmap.h"
 #include "shadowfb.h"
+#include "shadow.h"
+#include "damage.h"
+#ifdef XvExtension
+#include "xf86xv.h"
+#include <X11/extensions/Xv.h>
+#include "fourcc.h"
+#endif
+
+#include "cube_convert.h"
+#include "cube_trace.h"
+#include "cube_damage.h"
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
 
 #define TRUE 1
 #define FALSE 0
@@ -67,33 +90,181 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 
-typedef signed char        s8;
-typedef unsigned char      u8;
-typedef signed short int   s16;
-typedef unsigned short int u16;
-typedef signed long int    s32;
-typedef unsigned long int  u32;
+/* s8 to u32 come with cube_convert.h */
 typedef u8                 bool;
  
 /* Card-specific driver information */
 
 #define CUBEPTR(p) ((CUBEPtr)((p)->driverPrivate))
 
+#define CUBE_MAX_SCALE 4	/* ShadowScale */
+#define CUBE_L1_WAY 4096	/* bytes, a way of the 32KiB 8-way L1 dcache */
+#define CUBE_HUGETLBFS_MAGIC 0x958458f6	/* statfs() f_type of hugetlbfs */
+#define CUBE_BAND  16384	/* bytes of shadow per DirectPutImage band */
+
+/*
+ * The framebuffer device. It is opened and mapped once and kept across mode
+ * sets, VT switches and DPMS cycles, see CUBEFbOpen()/CUBEFbSetMode().
+ */
+typedef struct {
+  char                device[64]; /* Option "CubeDevice" */
+  int                 fd;         /* -1 while closed */
+  u8*                 map;        /* the whole mapping... */
+  s32                 maplen;
+  u8*                 mem;        /* ...and the pixels within it */
+  s32                 memlen;
+  u32                 pitch;      /* bytes per YUY2 line */
+  struct fb_fix_screeninfo finfo;
+  struct fb_var_screeninfo vinfo;
+  Bool                canBlank;   /* FBIOBLANK works, as far as we know */
+  int                 pages;      /* 2 when page flipping */
+  int                 front;      /* page being scanned out */
+  u32                 pageSize;   /* bytes */
+} CUBEFbRec, *CUBEFbPtr;
+
+/* where flushes draw: the visible page, or the back one when flipping */
+#define CUBE_FB_DRAW(pFb) \
+  ((pFb)->mem + ((pFb)->pages > 1 ? (pFb)->front ^ 1 : 0) * (pFb)->pageSize)
+#define CUBE_FB_PAGE(pFb, n) ((pFb)->mem + (n) * (pFb)->pageSize)
+
+#ifdef CUBE_THREADS
+/*
+ * Threaded: the conversion thread. The X server only drops damage boxes into
+ * a ring with one producer (X) and one consumer (the thread), so posting
+ * takes no locks; the thread owns the damage accumulator and does every
+ * flush. The lock and condition only serve CUBEWorkerPause().
+ */
+#define CUBE_RING_SIZE 256	/* boxes, a power of two */
+
+enum { CUBE_WORKER_RUN, CUBE_WORKER_PAUSE, CUBE_WORKER_PAUSED, CUBE_WORKER_QUIT };
+
+typedef struct {
+  pthread_t           thread;
+  Bool                running;
+  int                 paused;     /* X side nesting of CUBEWorkerPause() */
+  sem_t               wake;       /* posted along with new boxes */
+  pthread_mutex_t     lock;
+  pthread_cond_t      cond;
+  int                 state;      /* CUBE_WORKER_*, under lock */
+  volatile unsigned   head;       /* written by X only */
+  volatile unsigned   tail;       /* written by the thread only */
+  volatile int        overflow;   /* boxes were lost, repaint everything */
+  BoxRec              ring[CUBE_RING_SIZE];
+} CUBEWorkerRec, *CUBEWorkerPtr;
+#endif
+
+/*
+ * The pointer. It never touches the shadow: whoever flushes composites a
+ * YUY2 copy of it into the framebuffer page it draws, after converting, and
+ * brings back what it hid the same way when it moves.
+ */
+#define CUBE_CURSOR_SIZE  64
+#define CUBE_CURSOR_PAIRS (CUBE_CURSOR_SIZE / 2 + 1)	/* per row and phase */
+
+typedef struct {
+  /* set by the xf86Cursor hooks, SetCursorPosition from the SIGIO handler */
+  volatile int        x, y;       /* top left, may be off screen */
+  Bool                visible;
+  u32                 serial;     /* bumped with every new image */
+  volatile Bool       pending;    /* for CUBECursorBlockHandler() */
+  /* the image, converted for even and odd x (the phase) */
+  u32                 yuyv[2][CUBE_CURSOR_SIZE][CUBE_CURSOR_PAIRS];
+  u8                  mask[2][CUBE_CURSOR_SIZE][CUBE_CURSOR_PAIRS]; /* 1, 2: pixel shown */
+  /* the 2 colour image as xf86Cursor realized it, to recolour */
+  u8                  bits[CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE / 4];
+  Bool                mono;
+  int                 fg, bg;
+  /* flushing side only: the snapshot being drawn and what each page shows */
+  int                 boxX, boxY;
+  BoxRec              box;
+  u32                 boxSerial;
+  Bool                redraw;
+  BoxRec              drawn[2];
+  u32                 drawnSerial[2];
+} CUBECursorRec, *CUBECursorPtr;
+
+/*
+ * Stats: what the flushes got through since the last report. The conversion
+ * thread counts without a lock while the server reports and resets them, so
+ * a report may be off by a flush.
+ */
+typedef struct {
+  u32                 flushes;
+  u32                 boxes;      /* damage boxes received */
+  unsigned long long  rows;       /* rows converted... */
+  unsigned long long  rowsSame;   /* ...and left alone, their hash unchanged */
+  unsigned long long  tilesSame;  /* TileCache: damaged tiles left alone */
+  unsigned long long  pixels;     /* converted */
+  unsigned long long  black;      /* of these, in black pairs, */
+  unsigned long long  equal;      /* in pairs of one colour, */
+  unsigned long long  run;        /* in runs, see cube_convert_runs() */
+  unsigned long long  bytes;      /* written to the framebuffer */
+  u32                 ticks;      /* in flushes, see CUBETicks() */
+  u32                 ticksMax;
+  u32                 carried;    /* FrameBudget: bands left for a later frame */
+} CUBEStatsRec, *CUBEStatsPtr;
 
 typedef struct {
   u8*                 ShadowPtr;
-  u32                 ShadowPitch;
+  u32                 ShadowPitch;  /* padded, see CUBEShadowAlloc() */
+  pointer             ShadowBuf;    /* what to free, or */
+  pointer             ShadowMap;    /* unmap, */
+  size_t              ShadowMapLen;
+  int                 ShadowBpp;    /* bytes per shadow pixel, 2 or 4 */
+  /* the screen's size; ShadowScale times that is the framebuffer's */
+  int                 ShadowWidth;
+  int                 ShadowHeight;
+  int                 ShadowScale;
+  u32*                ScaleSrc;     /* a row of shadow pixels, scaled up */
+  u32*                ScaleLine;    /* and converted, for all its rows */
+  pointer             ScaleBuf;
   u32                 SST_Index;
   CloseScreenProcPtr  CloseScreen;
   Bool                Blanked;
+  Bool                Cleared;      /* blanked by clearing the framebuffer */
   Bool                OnAtExit;
   Bool                CubeInitiated;
   EntityInfoPtr       pEnt;
   OptionInfoPtr       Options;
-  s32                 mapped_offset;
-  s32                 mapped_memlen;
-  u8*                 mapped_mem;
-  int                 console_fd;  
+  CUBEFbRec           Fb;
+  CUBEDamageRec       Damage;
+  const CUBEConverterRec *Converter;
+  CUBEConvertCtx      Convert;      /* of this screen's flushes alone */
+  Bool                Staged;       /* converting through a staging line */
+  /* DeferredUpdate: damage comes from the shadow layer, flushed per frame */
+  Bool                Deferred;
+  Bool                DoubleBuffer;
+  u32                 FlushCost;    /* usecs, running average */
+  u32                 FrameBudget;  /* CUBETicks() per frame flush, 0 for all */
+  u32                 PixelCost;    /* CUBETicks() per 64Ki pixels flushed */
+  CreateScreenResourcesProcPtr CreateScreenResources;
+  OsTimerPtr          FlushTimer;
+  Bool                FlushPending;
+  OsTimerPtr          RepaintTimer;
+  int                 RepaintY;     /* next row to repaint, ShadowHeight: done */
+  Bool                HaveVSync;
+  u32                 FramePeriod;  /* usecs */
+  u32                 LastVBlank;   /* usecs, see CUBETime() */
+  Bool                Threaded;
+  Bool                TileCache;
+  int                 SpanCost;     /* pixels */
+  Bool                SWCursor;
+  Bool                DirectPutImage;
+  CreateGCProcPtr     CreateGC;     /* wrapped for DirectPutImage */
+  xf86CursorInfoPtr   CursorInfo;
+  CUBECursorPtr       Cursor;       /* NULL with the software cursor */
+  Bool                Stats;
+  int                 StatsInterval;  /* seconds, 0 for SIGUSR2 only */
+  OsTimerPtr          StatsTimer;
+  int                 StatsDumps;     /* CUBEStatsRequests last seen */
+  CUBEStatsRec        Counters;
+#ifdef CUBE_THREADS
+  CUBEWorkerRec       Worker;
+#endif
+  FILE*               Capture;      /* Option "CaptureFile", see cube_trace.h */
+#ifdef XvExtension
+  XF86VideoAdaptorPtr VideoAdaptor;
+#endif
 } CUBERec, *CUBEPtr;
 
 static const OptionInfoRec * CUBEAvailableOptions(int chipid, int busid);
@@ -105,11 +276,40 @@ static Bool	CUBEEnterVT(int scrnIndex, int flags);
 static void	CUBELeaveVT(int scrnIndex, int flags);
 static Bool	CUBECloseScreen(int scrnIndex, ScreenPtr pScreen);
 static Bool	CUBESaveScreen(ScreenPtr pScreen, int mode);
+static void	CUBEBlank(ScrnInfoPtr pScrn, int level);
 static void     CUBEFreeScreen(int scrnIndex, int flags);
 static void     CUBERefreshArea(ScrnInfoPtr pScrn, int num, BoxPtr pbox);
+static void     CUBECaptureOpen(ScrnInfoPtr pScrn);
+static void     CUBECaptureRecord(ScrnInfoPtr pScrn, CUBETraceType type,
+                                  int num, BoxPtr pbox);
 static Bool     CUBEModeInit(ScrnInfoPtr pScrn, DisplayModePtr mode);
 static void     CUBERestore(ScrnInfoPtr pScrn, Bool Closing);
-static void     CUBERefreshAll(ScrnInfoPtr pScrn);
+static void     CUBERepaintStart(ScrnInfoPtr pScrn);
+static void     CUBERepaintResume(ScrnInfoPtr pScrn);
+static void     CUBEKickFlush(ScrnInfoPtr pScrn);
+static void     CUBEFbClear(CUBEFbPtr pFb);
+static void     CUBEDamageFlush(CUBEPtr pCube, u32 budget);
+static void     CUBEFbFlip(ScrnInfoPtr pScrn);
+static Bool     CUBECreateScreenResources(ScreenPtr pScreen);
+static void     CUBEShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf);
+static void     CUBEScheduleFlush(ScrnInfoPtr pScrn);
+static s32      CUBEFlushDelay(CUBEPtr pCube);
+static void     CUBEFrameFlush(ScrnInfoPtr pScrn);
+static u32      CUBETime(void);
+static u32      CUBETicksPerMsec(void);
+static void     CUBEStatsInit(ScreenPtr pScreen);
+static void     CUBEStatsClose(ScreenPtr pScreen);
+static Bool     CUBECursorInit(ScreenPtr pScreen);
+static void     CUBECursorClose(ScreenPtr pScreen);
+static void     CUBECursorPrepare(CUBEPtr pCube);
+static void     CUBECursorFinish(CUBEPtr pCube, u8 *page);
+static Bool     CUBECursorChanged(CUBEPtr pCube);
+static void     CUBESelectConverter(ScrnInfoPtr pScrn);
+static Bool     CUBEGCInit(ScreenPtr pScreen);
+#ifdef XvExtension
+static void     CUBEInitVideo(ScreenPtr pScreen);
+static void     CUBECloseVideo(ScreenPtr pScreen);
+#endif
 
 static void	CUBEDisplayPowerManagementSet(ScrnInfoPtr pScrn,
                                                int PowerManagementMode,
@@ -118,8 +318,21 @@ static void	CUBEDisplayPowerManagementSet(ScrnInfoPtr pScrn,
 
 /*static int LoadGlide(void);
 */
-static int
-initFrameBuffer(ScrnInfoPtr pScrn);
+static Bool     CUBEShadowAlloc(ScrnInfoPtr pScrn);
+static void     CUBEShadowFree(CUBEPtr pCube);
+static Bool     CUBEFbOpen(ScrnInfoPtr pScrn);
+static Bool     CUBEFbSetMode(ScrnInfoPtr pScrn);
+static void     CUBEFbClose(CUBEPtr pCube);
+#ifdef CUBE_THREADS
+static Bool     CUBEWorkerStart(ScrnInfoPtr pScrn);
+static void     CUBEWorkerStop(CUBEPtr pCube);
+static void     CUBEWorkerPause(CUBEPtr pCube);
+static void     CUBEWorkerResume(CUBEPtr pCube);
+static void     CUBEWorkerPost(CUBEPtr pCube, int num, BoxPtr pbox);
+#else
+#define CUBEWorkerPause(pCube) do { } while (0)
+#define CUBEWorkerResume(pCube) do { } while (0)
+#endif
 #define CUBE_VERSION 1.0
 #define CUBE_NAME "CUBE"
 #define CUBE_DRIVER_NAME "cube"
@@ -147,12 +360,44 @@ _X_EXPORT DriverRec CUBE = {
 
 typedef enum {
   OPTION_ON_AT_EXIT,
-  OPTION_CUBEDEVICE
+  OPTION_CUBEDEVICE,
+  OPTION_DEFERRED_UPDATE,
+  OPTION_CONVERTER,
+  OPTION_DOUBLE_BUFFER,
+  OPTION_THREADED,
+  OPTION_TILE_CACHE,
+  OPTION_SW_CURSOR,
+  OPTION_STATS,
+  OPTION_STATS_INTERVAL,
+  OPTION_SPAN_COST,
+  OPTION_WRITE_STRATEGY,
+  OPTION_CHROMA,
+  OPTION_SHADOW_SCALE,
+  OPTION_SHADOW_MEMORY,
+  OPTION_DIRECT_PUT_IMAGE,
+  OPTION_FRAME_BUDGET,
+  OPTION_CAPTURE_FILE
 } CUBEOpts;
 
 static const OptionInfoRec CUBEOptions[] = {
   { OPTION_ON_AT_EXIT, "OnAtExit",       OPTV_BOOLEAN, {0}, FALSE },
-  { OPTION_CUBEDEVICE, "CubeDevice",   OPTV_INTEGER, {0}, FALSE },
+  { OPTION_CUBEDEVICE, "CubeDevice",     OPTV_STRING,  {0}, FALSE },
+  { OPTION_DEFERRED_UPDATE, "DeferredUpdate", OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_CONVERTER,  "Converter",      OPTV_STRING,  {0}, FALSE },
+  { OPTION_DOUBLE_BUFFER, "DoubleBuffer", OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_THREADED,   "Threaded",       OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_TILE_CACHE, "TileCache",      OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_SW_CURSOR,  "SWcursor",       OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_STATS,      "Stats",          OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_STATS_INTERVAL, "StatsInterval", OPTV_INTEGER, {0}, FALSE },
+  { OPTION_SPAN_COST,  "SpanCost",       OPTV_INTEGER, {0}, FALSE },
+  { OPTION_WRITE_STRATEGY, "WriteStrategy", OPTV_STRING, {0}, FALSE },
+  { OPTION_CHROMA,     "Chroma",         OPTV_STRING,  {0}, FALSE },
+  { OPTION_SHADOW_SCALE, "ShadowScale",  OPTV_INTEGER, {0}, FALSE },
+  { OPTION_SHADOW_MEMORY, "ShadowMemory", OPTV_STRING,  {0}, FALSE },
+  { OPTION_DIRECT_PUT_IMAGE, "DirectPutImage", OPTV_BOOLEAN, {0}, FALSE },
+  { OPTION_FRAME_BUDGET, "FrameBudget",  OPTV_INTEGER, {0}, FALSE },
+  { OPTION_CAPTURE_FILE, "CaptureFile",  OPTV_STRING,  {0}, FALSE },
   { -1,	               NULL,             OPTV_NONE,    {0}, FALSE }
 };
 
@@ -163,149 +408,6 @@ static SymTabRec CUBEChipsets[] = {
 };
 
 
-/**
-* This is the algorithm borrowed from libSDL port for gc-linux,
-* made by Albert "isobel" Herranz
-*
-* www.gc-linux.org
-*
-*/
-#define RGB2YUV_SHIFT   16
-#define RGB2YUV_LUMA    16
-#define RGB2YUV_CHROMA 128
-
-#define Yr ((int)( 0.299*(1<<RGB2YUV_SHIFT)))
-#define Yg ((int)( 0.587*(1<<RGB2YUV_SHIFT)))
-#define Yb ((int)( 0.114*(1<<RGB2YUV_SHIFT)))
-
-#define Ur ((int)(-0.169*(1<<RGB2YUV_SHIFT)))
-#define Ug ((int)(-0.331*(1<<RGB2YUV_SHIFT)))
-#define Ub ((int)( 0.500*(1<<RGB2YUV_SHIFT)))
-
-#define Vr ((int)( 0.500*(1<<RGB2YUV_SHIFT)))	/* same as Ub */
-#define Vg ((int)(-0.419*(1<<RGB2YUV_SHIFT)))
-#define Vb ((int)(-0.081*(1<<RGB2YUV_SHIFT)))
-
-#define clamp(x, y, z) ((z < x) ? x : ((z > y) ? y : z))
-
-static u32 r_Yr[256];
-static u32 g_Yg_[256];
-static u32 b_Yb[256];
-static u32 r_Ur[256];
-static u32 g_Ug_[256];
-static u32 b_Ub[256];
-/* static u32 r_Vr[256]; // space and cache optimisation */
-#define r_Vr b_Ub
-static u32 g_Vg_[256];
-static u32 b_Vb[256];
-
-static u8 RGB16toY[1 << 16];
-static u8 RGB16toU[1 << 16];
-static u8 RGB16toV[1 << 16];
-
-static void initRGB2YUVTables(void)
-{
-	int i;
-	int r, g, b;
-
-	for (i = 0; i < 256; i++) {
-		r_Yr[i] = Yr * i;
-		g_Yg_[i] = Yg * i + (RGB2YUV_LUMA << RGB2YUV_SHIFT);
-		b_Yb[i] = Yb * i;
-		r_Ur[i] = Ur * i;
-		g_Ug_[i] = Ug * i + (RGB2YUV_CHROMA << RGB2YUV_SHIFT);
-		b_Ub[i] = Ub * i;
-		r_Vr[i] = Vr * i;
-		g_Vg_[i] = Vg * i + (RGB2YUV_CHROMA << RGB2YUV_SHIFT);
-		b_Vb[i] = Vb * i;
-	}
-
-	for (i = 0; i < 1 << 16; i++) {
-#if 0
-		/* RGB555, extraction and (incorrect) scaling */
-		r = ((i >> 8) & 0xf8);
-		g = ((i >> 3) & 0xf8);
-		b = ((i << 2) & 0xf8);
-#endif
-#if 0
-		/* RGB565, extraction and (incorrect) scaling */
-		r = ((i >> 8) & 0xf8); /* ((i>>11)&0x1f)<<3*/
-		g = ((i >> 3) & 0xfc); /* ((i>>5)&0x3f)<<2*/
-		b = ((i << 3) & 0xf8); /* ((i>>0)&0x1f)<<3*/
-#endif
-		/* RGB565 */
-		r = ((i >> 11) & 0x1f);
-		g = ((i >> 5) & 0x3f);
-		b = ((i >> 0) & 0x1f);
-
-#if 0
-		/* fast (approximated) scaling to 8 bits, thanks to Masken */
-	        r = (r << 3) | (r >> 2);
-        	g = (g << 2) | (g >> 4);
-        	b = (b << 3) | (b >> 2);
-#endif
-		/* scaling to 8 bits */
-		r = (r * 0xff) / 0x1f;
-		g = (g * 0xff) / 0x3f;
-		b = (b * 0xff) / 0x1f;
-
-		RGB16toY[i] =
-		    clamp(16, 235,
-			  (r_Yr[r] + g_Yg_[g] + b_Yb[b]) >> RGB2YUV_SHIFT);
-		RGB16toU[i] =
-		    clamp(16, 240,
-			  (r_Ur[r] + g_Ug_[g] + b_Ub[b]) >> RGB2YUV_SHIFT);
-		RGB16toV[i] =
-		    clamp(16, 240,
-			  (r_Vr[r] + g_Vg_[g] + b_Vb[b]) >> RGB2YUV_SHIFT);
-	}
-}
-
-
-
-static inline u32 rgbrgb16toyuy2(u16 rgb1, u16 rgb2)
-{
-	register int Y1, Cb, Y2, Cr;
-	u16 rgb;
-
-	/* fast path, thanks to bohdy */
-	if (!(rgb1 | rgb2)) {
-		return 0x00800080;	/* black, black */
-	}
-
-	if (rgb1 == rgb2) {
-		/* fast path, thanks to isobel */
-		Y1 = Y2 = RGB16toY[rgb1];
-		Cb = RGB16toU[rgb1];
-		Cr = RGB16toV[rgb1];
-	} else {
-		Y1 = RGB16toY[rgb1];
-		Y2 = RGB16toY[rgb2];
-
-		/*
-		 * This computes a new rgb using the mean of r,g,b between
-		 * rgb1 and rgb2. Tricky.
-		 * --isobel
-		 */
-#if 0
-		/* this is for RGB555 */
-		rgb = (((rgb1 >> 1) & ~0x8421) + ((rgb2 >> 1) & ~0x8421))
-		    + ((rgb1 & rgb2) & 0x0842);
-#endif
-
-		/* this is for RGB565 */
-		rgb = (((rgb1 >> 1) & ~0x8410) + ((rgb2 >> 1) & ~0x8410))
-		    + ((rgb1 & rgb2) & 0x0841);
-
-		Cb = RGB16toU[rgb];
-		Cr = RGB16toV[rgb];
-	}
-
-	return (((char)Y1) << 24) | (((char)Cb) << 16) | (((char)Y2) << 8)
-	    | (((char)Cr) << 0);
-}
-
-
 /*
 *
 * This part was based on the Xfree86 Glide driver, and some parts were 
@@ -377,7 +479,7 @@ CUBEGetRec(ScrnInfoPtr pScrn)
   pScrn->driverPrivate = xnfcalloc(sizeof(CUBERec), 1);
 
   /* Initialize it */
-  /* No init here yet */
+  CUBEPTR(pScrn)->Fb.fd = -1;
   return TRUE;
 }
 
@@ -386,6 +488,9 @@ CUBEFreeRec(ScrnInfoPtr pScrn)
 {
   if (pScrn->driverPrivate == NULL)
     return;
+  CUBEFbClose(CUBEPTR(pScrn));
+  if (CUBEPTR(pScrn)->Capture)
+    fclose(CUBEPTR(pScrn)->Capture);
   xfree(pScrn->driverPrivate);
   pScrn->driverPrivate = NULL;
 }
@@ -426,7 +531,7 @@ CUBEProbe(DriverPtr drv, int flags)
 	
 	for (i = 0; i < numDevSections; i++) {
 	  
-	    dev = xf86FindOptionValue(devSections[i]->options,"cube");
+	    dev = xf86FindOptionValue(devSections[i]->options,"CubeDevice");
 
  	 	  pScrn = NULL;
   	  int entity;
@@ -469,7 +574,8 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
   MessageType from;
   int i;
   ClockRangePtr clockRanges;
-  int sst;
+  const char *dev;
+  int sst, budget;
 
 
   if (flags & PROBE_DETECT) return FALSE;
@@ -490,7 +596,9 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
 
   /* Check that the returned depth is one we support */
   switch (pScrn->depth) {
-  case 16: //We only sopport 16bpp
+  case 15: /* as RGB555, with the "fixed" converter only */
+  case 16:
+  case 24: /* as x8r8g8b8, Support32bppFb only */
     /* OK */
     break;
   default:
@@ -547,8 +655,9 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
   }
 
   pCube = CUBEPTR(pScrn);
-  //time to setup our framebuffer
-  initFrameBuffer(pScrn);
+  initRGB2YUVTables();
+  cube_convert_init(&pCube->Convert);
+
   /* Get the entity */
   pCube->pEnt = xf86GetEntityInfo(pScrn->entityList[0]);
 
@@ -561,6 +670,21 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
   memcpy(pCube->Options, CUBEOptions, sizeof(CUBEOptions));
   xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, pCube->Options);
 
+  /* time to setup our framebuffer: CubeDevice is a path, or an fb number */
+  dev = xf86GetOptValString(pCube->Options, OPTION_CUBEDEVICE);
+  from = dev ? X_CONFIG : X_DEFAULT;
+  if (!dev)
+    dev = "0";
+  if (*dev && dev[strspn(dev, "0123456789")] == '\0')
+    snprintf(pCube->Fb.device, sizeof(pCube->Fb.device), "/dev/fb%s", dev);
+  else
+    snprintf(pCube->Fb.device, sizeof(pCube->Fb.device), "%s", dev);
+  xf86DrvMsg(pScrn->scrnIndex, from, "Using %s\n", pCube->Fb.device);
+  if (!CUBEFbOpen(pScrn)) {
+    CUBEFreeRec(pScrn);
+    return FALSE;
+  }
+
   pCube->OnAtExit = FALSE;
   from = X_DEFAULT;
   if (xf86GetOptValBool(pCube->Options, OPTION_ON_AT_EXIT, &(pCube->OnAtExit)))
@@ -570,6 +694,112 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
              "Cube card will be %s when exiting server.\n", 
              pCube->OnAtExit ? "ON" : "OFF");
 
+  pCube->Deferred = FALSE;
+  from = X_DEFAULT;
+  if (xf86GetOptValBool(pCube->Options, OPTION_DEFERRED_UPDATE, &(pCube->Deferred)))
+    from = X_CONFIG;
+
+  /* flipping on every drawing operation would make no sense */
+  pCube->DoubleBuffer = FALSE;
+  if (xf86GetOptValBool(pCube->Options, OPTION_DOUBLE_BUFFER, &(pCube->DoubleBuffer)) &&
+      pCube->DoubleBuffer && !pCube->Deferred) {
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+               "DoubleBuffer implies DeferredUpdate\n");
+    pCube->Deferred = TRUE;
+  }
+
+  xf86DrvMsg(pScrn->scrnIndex, from,
+             "Screen updates will be %s.\n",
+             pCube->Deferred ? "deferred to the display refresh" : "immediate");
+
+  pCube->FrameBudget = 0;
+  pCube->PixelCost = 0;
+  if (xf86GetOptValInteger(pCube->Options, OPTION_FRAME_BUDGET, &budget) &&
+      budget > 0) {
+    if (pCube->Deferred) {
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                 "Converting at most %d usecs' worth of damage a frame\n",
+                 budget);
+      pCube->FrameBudget = (unsigned long long) budget * CUBETicksPerMsec() /
+                           1000;
+    } else {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "FrameBudget: only with DeferredUpdate\n");
+    }
+  }
+
+  pCube->SWCursor = FALSE;
+  from = X_DEFAULT;
+  if (xf86GetOptValBool(pCube->Options, OPTION_SW_CURSOR, &(pCube->SWCursor)))
+    from = X_CONFIG;
+  xf86DrvMsg(pScrn->scrnIndex, from, "Using %s cursor\n",
+             pCube->SWCursor ? "the software" : "a framebuffer composited");
+
+  /* the shadow layer's damage wouldn't see what it skips */
+  pCube->DirectPutImage = FALSE;
+  if (xf86GetOptValBool(pCube->Options, OPTION_DIRECT_PUT_IMAGE,
+                        &(pCube->DirectPutImage)) && pCube->DirectPutImage) {
+    if (pCube->Deferred) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "DirectPutImage: not with DeferredUpdate\n");
+      pCube->DirectPutImage = FALSE;
+    } else
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                 "Converting large images as they are put\n");
+  }
+
+  pCube->TileCache = FALSE;
+  if (xf86GetOptValBool(pCube->Options, OPTION_TILE_CACHE, &(pCube->TileCache)) &&
+      pCube->TileCache)
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+               "Skipping unchanged %dx%d tiles\n", CUBE_TILE, CUBE_TILE);
+
+  pCube->Threaded = FALSE;
+  if (xf86GetOptValBool(pCube->Options, OPTION_THREADED, &(pCube->Threaded)) &&
+      pCube->Threaded) {
+#ifdef CUBE_THREADS
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+               "Converting in a separate thread\n");
+#else
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "Threaded: this driver was built without thread support\n");
+    pCube->Threaded = FALSE;
+#endif
+  }
+
+  pCube->SpanCost = CUBE_SPAN_COST;
+  from = X_DEFAULT;
+  if (xf86GetOptValInteger(pCube->Options, OPTION_SPAN_COST, &pCube->SpanCost))
+    from = X_CONFIG;
+  if (pCube->SpanCost < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "SpanCost can't be negative, using %d\n", CUBE_SPAN_COST);
+    pCube->SpanCost = CUBE_SPAN_COST;
+    from = X_DEFAULT;
+  }
+  xf86DrvMsg(pScrn->scrnIndex, from,
+             "Converting damage up to %d pixels apart in one go\n",
+             pCube->SpanCost);
+
+  pCube->Stats = FALSE;
+  pCube->StatsInterval = 0;
+  if (xf86GetOptValInteger(pCube->Options, OPTION_STATS_INTERVAL,
+                           &pCube->StatsInterval)) {
+    pCube->Stats = pCube->StatsInterval > 0;
+    if (pCube->StatsInterval < 0)
+      pCube->StatsInterval = 0;
+  }
+  xf86GetOptValBool(pCube->Options, OPTION_STATS, &(pCube->Stats));
+  if (pCube->Stats) {
+    if (pCube->StatsInterval)
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                 "Reporting refresh stats every %d seconds and on SIGUSR2\n",
+                 pCube->StatsInterval);
+    else
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                 "Reporting refresh stats on SIGUSR2\n");
+  }
+
   pCube->SST_Index = sst;
 
   /*
@@ -580,7 +810,7 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
     pScrn->videoRam = pCube->pEnt->device->videoRam;
     from = X_CONFIG;
   } else {
-    pScrn->videoRam = pCube->mapped_memlen; 
+    pScrn->videoRam = pCube->Fb.memlen / 1024;
     from = X_PROBED;
   }
 
@@ -594,14 +824,17 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
   clockRanges->interlaceAllowed = TRUE;
   clockRanges->doubleScanAllowed = TRUE;
 
-  /* Select valid modes from those available */
+  /*
+   * Select valid modes from those available. Whatever the depth, the
+   * framebuffer only ever holds 16 bit YUY2; the deeper shadow is in RAM.
+   */
   i = xf86ValidateModes(pScrn, pScrn->monitor->Modes,
                         pScrn->display->modes, clockRanges,
                         NULL, 256, 2048,
                         pScrn->bitsPerPixel, 128, 2048,
                         pScrn->display->virtualX,
                         pScrn->display->virtualY,
-                        pScrn->videoRam * 1024,
+                        pScrn->videoRam * 1024 * (pScrn->bitsPerPixel / 16),
                         LOOKUP_BEST_REFRESH);
     
   if (i == -1) {
@@ -639,6 +872,38 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
     pScrn->displayWidth = pScrn->virtualX;
   }
 
+  /*
+   * ShadowScale: X gets a screen that many times smaller each way, which
+   * the conversion scales up to the mode. Pixel pairs at both sizes.
+   */
+  pCube->ShadowScale = 1;
+  if (xf86GetOptValInteger(pCube->Options, OPTION_SHADOW_SCALE,
+                           &pCube->ShadowScale)) {
+    if (pCube->ShadowScale < 1 || pCube->ShadowScale > CUBE_MAX_SCALE ||
+        pScrn->virtualX % (pCube->ShadowScale * 2) ||
+        pScrn->virtualY % pCube->ShadowScale) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "ShadowScale %d doesn't divide %dx%d, not scaling\n",
+                 pCube->ShadowScale, pScrn->virtualX, pScrn->virtualY);
+      pCube->ShadowScale = 1;
+    } else if (pCube->ShadowScale > 1) {
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                 "Scaling a %dx%d screen up to %dx%d\n",
+                 pScrn->virtualX / pCube->ShadowScale,
+                 pScrn->virtualY / pCube->ShadowScale,
+                 pScrn->virtualX, pScrn->virtualY);
+      /* ours would be drawn unscaled */
+      if (!pCube->SWCursor)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "ShadowScale: using the software cursor\n");
+      pCube->SWCursor = TRUE;
+    }
+  }
+  pCube->ShadowWidth = pScrn->virtualX / pCube->ShadowScale;
+  pCube->ShadowHeight = pScrn->virtualY / pCube->ShadowScale;
+
+  CUBECaptureOpen(pScrn);
+
   /* TODO (From glide driver) : Note: If I return FALSE right here, the server will not restore the console correctly,
      forcing a reboot. Must find that. (valid for 3.9Pi) */
 
@@ -654,15 +919,142 @@ CUBEPreInit(ScrnInfoPtr pScrn, int flags)
     return FALSE;
   }
 
-  /* Load the shadow framebuffer */
-  if (!xf86LoadSubModule(pScrn, "shadowfb")) {
+  /* Load the shadow framebuffer, or the damage based shadow layer */
+  if (!xf86LoadSubModule(pScrn, pCube->Deferred ? "shadow" : "shadowfb")) {
     CUBEFreeRec(pScrn);
     return FALSE;
   }
 
+  /* xf86InitCursor(), for our cursor */
+  if (!pCube->SWCursor && !xf86LoadSubModule(pScrn, "ramdac")) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "Couldn't load ramdac, using the software cursor\n");
+    pCube->SWCursor = TRUE;
+  }
+
+  return TRUE;
+}
+
+
+/*
+ * The shadow. Rows start on cache lines and take an odd number of them, so
+ * the rows of a band don't all land in the same few L1 sets, and the buffer
+ * starts half a cache way into a page, away from the sets of the (page
+ * aligned) framebuffer rows it is converted to. Option "ShadowMemory" says
+ * where it lives: on the heap, in a hugepage, which saves TLB misses when
+ * the rows of a band are a page apart each, or in a file mapped shared, such
+ * as one on a hugetlbfs mount or a device exposing a region of memory of
+ * its own, like the Wii's MEM2.
+ */
+
+/* The default hugepage size, which hugepage mappings are a multiple of */
+static size_t
+CUBEHugePageSize(void)
+{
+  char line[80];
+  unsigned long kb = 0;
+  FILE *f;
+
+  f = fopen("/proc/meminfo", "r");
+  if (f) {
+    while (fgets(line, sizeof(line), f))
+      if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+        break;
+    fclose(f);
+  }
+  return kb ? kb << 10 : 2 << 20;
+}
+
+static Bool
+CUBEShadowAlloc(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  const char *where;
+  size_t len, maplen = 0;
+  struct stat st;
+  struct statfs sfs;
+  u8 *mem = NULL;
+  int fd;
+
+  pCube->ShadowPitch = (pCube->ShadowWidth * pCube->ShadowBpp + CUBE_BURST - 1) &
+                       ~(CUBE_BURST - 1);
+  if (!(pCube->ShadowPitch / CUBE_BURST & 1))
+    pCube->ShadowPitch += CUBE_BURST;
+  len = pCube->ShadowPitch * pCube->ShadowHeight + CUBE_L1_WAY;
+
+  where = xf86GetOptValString(pCube->Options, OPTION_SHADOW_MEMORY);
+  if (where && !xf86NameCmp(where, "hugepage")) {
+#ifdef MAP_HUGETLB
+    /* munmap() wants the length in whole hugepages too */
+    maplen = (len + CUBEHugePageSize() - 1) & ~(CUBEHugePageSize() - 1);
+    mem = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#else
+    mem = MAP_FAILED;
+#endif
+    if (mem == MAP_FAILED) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "ShadowMemory: no hugepages, using the heap\n");
+      mem = NULL;
+    }
+  } else if (where && *where == '/') {
+    fd = open(where, O_RDWR, 0);
+    mem = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size < (off_t) len) {
+      /* past its end the mapping would SIGBUS, not fail */
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "ShadowMemory: %s is %ld bytes, the shadow needs %lu,"
+                 " using the heap\n", where, (long) st.st_size,
+                 (unsigned long) len);
+      mem = NULL;
+    } else if (fd >= 0) {
+      maplen = len;
+      if (fstatfs(fd, &sfs) == 0 && sfs.f_type == CUBE_HUGETLBFS_MAGIC)
+        maplen = (len + sfs.f_bsize - 1) & ~(sfs.f_bsize - 1);
+      mem = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+      close(fd);
+    if (mem == MAP_FAILED) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "ShadowMemory: can't map %s, using the heap\n", where);
+      mem = NULL;
+    }
+  } else if (where && xf86NameCmp(where, "heap")) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "ShadowMemory \"%s\" unknown, using the heap\n", where);
+  }
+
+  if (mem) {
+    /* mappings are page aligned already */
+    pCube->ShadowMap = mem;
+    pCube->ShadowMapLen = maplen;
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "ShadowMemory: %s\n", where);
+  } else {
+    pCube->ShadowBuf = xalloc(len + CUBE_L1_WAY);
+    if (!pCube->ShadowBuf) {
+      xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                 "Couldn't allocate the shadow framebuffer\n");
+      return FALSE;
+    }
+    mem = (u8 *) (((unsigned long) pCube->ShadowBuf + CUBE_L1_WAY - 1) &
+                  ~(CUBE_L1_WAY - 1L));
+  }
+  pCube->ShadowPtr = mem + CUBE_L1_WAY / 2;
+  memset(pCube->ShadowPtr, 0, pCube->ShadowPitch * pCube->ShadowHeight);
   return TRUE;
 }
 
+static void
+CUBEShadowFree(CUBEPtr pCube)
+{
+  if (pCube->ShadowMap)
+    munmap(pCube->ShadowMap, pCube->ShadowMapLen);
+  xfree(pCube->ShadowBuf);
+  pCube->ShadowMap = pCube->ShadowBuf = NULL;
+  pCube->ShadowPtr = NULL;
+}
 
 /* Mandatory */
 /* This gets called at the start of each server generation */
@@ -707,8 +1099,32 @@ CUBEScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 
   miSetPixmapDepths ();
 
-  pCube->ShadowPitch = ((pScrn->virtualX * pScrn->bitsPerPixel >> 3) + 3) & ~3L;
-  pCube->ShadowPtr = xnfalloc(pCube->ShadowPitch * pScrn->virtualY);
+  pCube->ShadowBpp = pScrn->bitsPerPixel >> 3;
+  if (!CUBEShadowAlloc(pScrn))
+    return FALSE;
+  /* a generation starts over from an empty shadow */
+  CUBECaptureRecord(pScrn, CUBE_TRACE_RESET, 0, NULL);
+
+  /* a framebuffer row, at the shadow's depth and then in YUY2 */
+  if (pCube->ShadowScale > 1) {
+    pCube->ScaleBuf = xnfalloc(pScrn->virtualX * (pCube->ShadowBpp + 2) +
+                               3 * CUBE_BURST);
+    pCube->ScaleSrc = (u32 *) (((unsigned long) pCube->ScaleBuf +
+                                CUBE_BURST - 1) & ~(CUBE_BURST - 1L));
+    pCube->ScaleLine = (u32 *) (((unsigned long) pCube->ScaleSrc +
+                                 pScrn->virtualX * pCube->ShadowBpp +
+                                 CUBE_BURST - 1) & ~(CUBE_BURST - 1L));
+  }
+
+  if (!CUBEDamageInit(&pCube->Damage, pCube->ShadowWidth, pCube->ShadowHeight,
+                      pCube->TileCache))
+    return FALSE;
+  pCube->Damage.gap = pCube->SpanCost;
+  if (pCube->Fb.pitch % CUBE_BURST == 0 &&
+      (unsigned long) pCube->Fb.mem % CUBE_BURST == 0)
+    pCube->Damage.align = CUBE_BURST / 2;
+
+  CUBESelectConverter(pScrn);
 
   
   /*
@@ -716,9 +1132,10 @@ CUBEScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
    * pScreen fields.
    */
   ret = fbScreenInit(pScreen, pCube->ShadowPtr,
-		     pScrn->virtualX, pScrn->virtualY,
-		     pScrn->xDpi, pScrn->yDpi,
-		     pScrn->displayWidth,
+		     pCube->ShadowWidth, pCube->ShadowHeight,
+		     pScrn->xDpi / pCube->ShadowScale,
+		     pScrn->yDpi / pCube->ShadowScale,
+		     pCube->ShadowPitch / pCube->ShadowBpp,
 		     pScrn->bitsPerPixel);
 
   if (!ret)
@@ -740,6 +1157,15 @@ CUBEScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
   /* must be after RGB ordering fixed */
   fbPictureInit (pScreen, 0, 0);
 
+  if (pCube->Deferred) {
+    if (!shadowSetup(pScreen)) {
+      xf86DrvMsg(scrnIndex, X_ERROR, "Shadow layer initialization failed\n");
+      return FALSE;
+    }
+    pCube->CreateScreenResources = pScreen->CreateScreenResources;
+    pScreen->CreateScreenResources = CUBECreateScreenResources;
+  }
+
   miInitializeBackingStore(pScreen);
   xf86SetBlackWhitePixels(pScreen);
   xf86SetBackingStore(pScreen);
@@ -748,11 +1174,43 @@ CUBEScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
      Must precede creation of the default colormap */
   miDCInitialize(pScreen, xf86GetPointerScreenFuncs());
 
+  /* and on top of it ours, which doesn't damage the shadow */
+  if (!pCube->SWCursor && !CUBECursorInit(pScreen)) {
+    xf86DrvMsg(scrnIndex, X_WARNING,
+               "Cursor initialization failed, using the software cursor\n");
+    pCube->SWCursor = TRUE;
+  }
+
   /* Initialise default colourmap */
   if (!miCreateDefColormap(pScreen))
     return FALSE;
 
-  ShadowFBInit(pScreen, CUBERefreshArea);
+  if (!pCube->Deferred)
+    ShadowFBInit(pScreen, CUBERefreshArea);
+
+  /*
+   * Above ShadowFB, which never sees what it copies. Neither would the
+   * software cursor's damage; and the conversion thread converting the
+   * bands later gains nothing.
+   */
+  if (pCube->DirectPutImage && (pCube->SWCursor || pCube->Threaded)) {
+    xf86DrvMsg(scrnIndex, X_INFO,
+               "DirectPutImage: not with %s\n",
+               pCube->SWCursor ? "the software cursor" : "Threaded");
+    pCube->DirectPutImage = FALSE;
+  }
+  if (pCube->DirectPutImage && !CUBEGCInit(pScreen)) {
+    xf86DrvMsg(scrnIndex, X_WARNING, "DirectPutImage: no GC private\n");
+    pCube->DirectPutImage = FALSE;
+  }
+
+#ifdef XvExtension
+  /* the adaptor writes the framebuffer at the screen's own size */
+  if (pCube->ShadowScale == 1)
+    CUBEInitVideo(pScreen);
+  else
+    xf86DrvMsg(scrnIndex, X_INFO, "ShadowScale: no Xv\n");
+#endif
 
   xf86DPMSInit(pScreen, CUBEDisplayPowerManagementSet, 0);
 
@@ -767,6 +1225,17 @@ CUBEScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     xf86ShowUnusedOptions(pScrn->scrnIndex, pScrn->options);
   }
 
+  if (pCube->Stats)
+    CUBEStatsInit(pScreen);
+
+#ifdef CUBE_THREADS
+  if (pCube->Threaded && !CUBEWorkerStart(pScrn)) {
+    xf86DrvMsg(scrnIndex, X_WARNING,
+               "Couldn't start the conversion thread, converting inline\n");
+    pCube->Threaded = FALSE;
+  }
+#endif
+
 #if 0
   LoaderCheckUnresolved(LD_RESOLV_NOW);
   return FALSE;
@@ -790,6 +1259,8 @@ static Bool
 CUBEEnterVT(int scrnIndex, int flags)
 {
   ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
+
+  /* the picture comes back in the background, see CUBERepaintStart() */
   return CUBEModeInit(pScrn, pScrn->currentMode);
 }
 
@@ -822,23 +1293,41 @@ CUBECloseScreen(int scrnIndex, ScreenPtr pScreen)
   ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
   CUBEPtr pCube = CUBEPTR(pScrn);
 
+#ifdef CUBE_THREADS
+  CUBEWorkerStop(pCube);
+#endif
   if (pScrn->vtSema)
       CUBERestore(pScrn, TRUE);
-  xfree(pCube->ShadowPtr);
+  CUBEShadowFree(pCube);
+  xfree(pCube->ScaleBuf);
+  pCube->ScaleBuf = NULL;
+  pCube->ScaleSrc = pCube->ScaleLine = NULL;
+  CUBEDamageFree(&pCube->Damage);
+  CUBECursorClose(pScreen);
+  CUBEStatsClose(pScreen);
+#ifdef XvExtension
+  CUBECloseVideo(pScreen);
+#endif
 
   pScrn->vtSema = FALSE;
 
-  pScreen->CloseScreen = pCube->CloseScreen;
-  if (pCube->console_fd > 0) {
-		/* Unmap the video framebuffer and I/O registers */
-		if (pCube->mapped_mem) {
-			munmap(pCube->mapped_mem, pCube->mapped_memlen);
-			pCube->mapped_mem = NULL;
-		}
+  if (pCube->FlushTimer) {
+    TimerFree(pCube->FlushTimer);
+    pCube->FlushTimer = NULL;
+  }
+  pCube->FlushPending = FALSE;
+  if (pCube->RepaintTimer) {
+    TimerFree(pCube->RepaintTimer);
+    pCube->RepaintTimer = NULL;
+  }
 
-		close(pCube->console_fd);
-		pCube->console_fd = -1;
-	}
+  if (pCube->CreateGC) {
+    pScreen->CreateGC = pCube->CreateGC;
+    pCube->CreateGC = NULL;
+  }
+
+  /* the framebuffer stays mapped for the next generation */
+  pScreen->CloseScreen = pCube->CloseScreen;
   return (*pScreen->CloseScreen)(scrnIndex, pScreen);
 }
 
@@ -855,8 +1344,8 @@ CUBEFreeScreen(int scrnIndex, int flags)
    * This only gets called when a screen is being deleted.  It does not
    * get called routinely at the end of a server generation.
    */
-  if (pCube && pCube->ShadowPtr)
-    xfree(pCube->ShadowPtr);
+  if (pCube)
+    CUBEShadowFree(pCube);
   CUBEFreeRec(xf86Screens[scrnIndex]);
 }
 
@@ -872,22 +1361,57 @@ CUBESaveScreen(ScreenPtr pScreen, int mode)
   
   unblank = xf86IsUnblank(mode);
   pScrn = xf86Screens[pScreen->myNum];
-  pCube = CUBEPTR(pScrn);
-  pCube->Blanked = !unblank;
-  if (unblank)
-    CUBERefreshAll(pScrn);
-  else
-    memset(pCube->mapped_mem,0,pCube->mapped_memlen);
-
-
+  CUBEBlank(pScrn, unblank ? FB_BLANK_UNBLANK : FB_BLANK_NORMAL);
   return TRUE;
 }
 
+/*
+ * Blanking, for the screen saver and DPMS. Where the kernel implements
+ * FBIOBLANK the picture merely goes dark and stays in the framebuffer;
+ * damage keeps being accumulated meanwhile, so unblanking only converts
+ * what changed. Otherwise the screen is filled with black once, and
+ * converted again in full when it comes back.
+ */
+static void
+CUBEBlank(ScrnInfoPtr pScrn, int level)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBEFbPtr pFb = &pCube->Fb;
+  Bool blank = level != FB_BLANK_UNBLANK;
+  Bool wasBlanked, cleared;
+
+  CUBEWorkerPause(pCube);
+  if (pFb->canBlank && pFb->fd >= 0 && ioctl(pFb->fd, FBIOBLANK, level) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "FBIOBLANK not supported, blanking by clearing the screen\n");
+    pFb->canBlank = FALSE;
+  }
+  if (blank && !pCube->Blanked && !pFb->canBlank) {
+    CUBEFbClear(pFb);
+    CUBEDamageInvalidate(&pCube->Damage);
+    pCube->Cleared = TRUE;
+  }
+  wasBlanked = pCube->Blanked;
+  cleared = pCube->Cleared;
+  pCube->Blanked = blank;
+  if (!blank)
+    pCube->Cleared = FALSE;
+  CUBEWorkerResume(pCube);
+
+  if (blank || !wasBlanked)
+    return;
+  if (cleared) {
+    CUBERepaintStart(pScrn);
+  } else {
+    CUBEKickFlush(pScrn);
+    CUBERepaintResume(pScrn);
+  }
+}
+
 static Bool
 CUBEModeInit(ScrnInfoPtr pScrn, DisplayModePtr mode)
 {
   CUBEPtr pCube;
-  int r;
   int width, height;
   double refresh;
   Bool match = FALSE;
@@ -910,7 +1434,8 @@ CUBEModeInit(ScrnInfoPtr pScrn, DisplayModePtr mode)
   ErrorF("mode->Clock = %d\n", mode->Clock);
 #endif
 
-  if (width == 640 && ((height == 480)||(height == 576)))
+  /* YUY2 comes in pixel pairs; whether it fits is up to CUBEFbSetMode() */
+  if (!(width & 1) && width > 0 && height > 0)
   {
     match = TRUE;
   }
@@ -928,19 +1453,37 @@ CUBEModeInit(ScrnInfoPtr pScrn, DisplayModePtr mode)
   ErrorF("Calculated refresh rate for mode is %.2fHz\n",refresh);
 #endif
 
- 
-  r=initFrameBuffer(pScrn);    
-                    
-  if (!r)
+  /* the framebuffer may move under a running conversion thread */
+  CUBEWorkerPause(pCube);
+  if (!CUBEFbOpen(pScrn) || !CUBEFbSetMode(pScrn))
   {
-    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "grSstWinOpen returned %d. "
-               "You are probably trying to use a resolution that is not supported by your hardware.", r);
+    CUBEWorkerResume(pCube);
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Framebuffer setup failed. "
+               "You are probably trying to use a resolution that is not supported by your hardware.\n");
     return FALSE;
   }
 
-  memset(pCube->mapped_mem,0,pCube->mapped_memlen);
+  /* Pace deferred flushes to the display refresh */
+  if (refresh < 20.0 || refresh > 100.0)
+    refresh = (height == 576) ? 50.0 : 60.0;
+  pCube->FramePeriod = (u32)(1.0e6 / refresh);
+  if (pCube->Deferred) {
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "Flushing at most every %u usecs, paced by %s\n",
+               (unsigned)pCube->FramePeriod,
+               pCube->HaveVSync ? "vertical retrace" : "a timer");
+  }
+
+  /* a new mode shows a black screen, whatever we blanked before */
+  if (pCube->Blanked && pCube->Fb.canBlank)
+    ioctl(pCube->Fb.fd, FBIOBLANK, FB_BLANK_UNBLANK);
+  CUBEFbClear(&pCube->Fb);
+  CUBEDamageInvalidate(&pCube->Damage);
   pCube->Blanked = FALSE;
+  pCube->Cleared = FALSE;
   pCube->CubeInitiated = TRUE;
+  CUBEWorkerResume(pCube);
+  CUBERepaintStart(pScrn);
   return TRUE;
 }
 
@@ -954,188 +1497,2514 @@ CUBERestore(ScrnInfoPtr pScrn, Bool Closing)
   if (!(pCube->CubeInitiated))
     return;
   pCube->CubeInitiated = FALSE;
+  CUBEWorkerPause(pCube);
   pCube->Blanked = TRUE;
-  memset(pCube->mapped_mem,0,pCube->mapped_memlen);
+  CUBEFbClear(&pCube->Fb);
+  CUBEDamageInvalidate(&pCube->Damage);
+  pCube->Cleared = TRUE;
+  CUBEWorkerResume(pCube);
 }
 
 
 
-static int
-initFrameBuffer(ScrnInfoPtr pScrn)
+/*
+ * Framebuffer session
+ */
+
+/* Black, in YUY2: zero luma, but neutral chroma, which isn't zero */
+static void
+CUBEFbClear(CUBEFbPtr pFb)
 {
-  CUBEPtr pCube;
-  pCube = CUBEPTR(pScrn);
-  
-  struct fb_fix_screeninfo finfo;
-	struct fb_var_screeninfo vinfo;
-	const char *fbdev;
- 
-  initRGB2YUVTables();
+  if (pFb->mem)
+    cube_fill32((u32 *) pFb->mem, 0x00800080, pFb->memlen / 4);
+}
 
-	/* Initialize the library */
-   fbdev = "/dev/fb0";
+static Bool
+CUBEFbMap(ScrnInfoPtr pScrn)
+{
+  CUBEFbPtr pFb = &CUBEPTR(pScrn)->Fb;
+
+  /* Memory map the device, compensating for buggy PPC mmap() */
+  pFb->maplen = pFb->finfo.smem_len +
+                (pFb->finfo.smem_start & (sysconf(_SC_PAGESIZE) - 1));
+  pFb->map = mmap(NULL, pFb->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  pFb->fd, 0);
+  if (pFb->map == MAP_FAILED) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+               "Unable to memory map the video hardware\n");
+    pFb->map = NULL;
+    return FALSE;
+  }
+  pFb->mem = pFb->map + (pFb->maplen - pFb->finfo.smem_len);
+  pFb->memlen = pFb->finfo.smem_len;
+  return TRUE;
+}
 
-	pCube->console_fd = open(fbdev, O_RDWR, 0);
-	if (pCube->console_fd < 0) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Unable to open %s", fbdev);
-		return (-1);
-	}
+static void
+CUBEFbUnmap(CUBEFbPtr pFb)
+{
+  if (pFb->map)
+    munmap(pFb->map, pFb->maplen);
+  pFb->map = NULL;
+  pFb->mem = NULL;
+}
 
-	/* Get the type of video hardware */
-	if (ioctl(pCube->console_fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,"Couldn't get console hardware info");
-		return (-1);
-	}
-	switch (finfo.type) {
-	case FB_TYPE_PACKED_PIXELS:
-		/* Supported, no worries.. */
-		break;
-	default:
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,"Unsupported console hardware");
-		return (-1);
-	}
-	switch (finfo.visual) {
-	case FB_VISUAL_TRUECOLOR:
-		/* Supported, no worries.. */
-		break;
-	default:
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,"Unsupported console hardware");
-		return (-1);
-	}
+/* Open and map the framebuffer, unless that has been done already */
+static Bool
+CUBEFbOpen(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBEFbPtr pFb = &pCube->Fb;
+  u32 crtc = 0;
 
-	/* Memory map the device, compensating for buggy PPC mmap() */
-	pCube->mapped_offset = (((long)finfo.smem_start) -
-			 (((long)finfo.smem_start) & ~(sysconf(_SC_PAGESIZE) - 1)));
-	pCube->mapped_memlen = finfo.smem_len + pCube->mapped_offset;
-	pCube->mapped_mem = mmap(NULL, pCube->mapped_memlen,
-			  PROT_READ | PROT_WRITE, MAP_SHARED, pCube->console_fd, 0);
-	if (pCube->mapped_mem == (char *)-1) {
-    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,"Unable to memory map the video hardware");
-		pCube->mapped_mem = NULL;
-		return (-1);
-	}
+  if (pFb->fd >= 0)
+    return TRUE;
 
-	/* Determine the current screen depth */
-	if (ioctl(pCube->console_fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,"Couldn't get console pixel format");
-		return (-1);
-	}
+  pFb->fd = open(pFb->device, O_RDWR, 0);
+  if (pFb->fd < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Unable to open %s\n", pFb->device);
+    return FALSE;
+  }
 
+  /* Get the type of video hardware */
+  if (ioctl(pFb->fd, FBIOGET_FSCREENINFO, &pFb->finfo) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Couldn't get console hardware info\n");
+    goto fail;
+  }
+  if (pFb->finfo.type != FB_TYPE_PACKED_PIXELS ||
+      pFb->finfo.visual != FB_VISUAL_TRUECOLOR) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Unsupported console hardware\n");
+    goto fail;
+  }
 
-	
-	vinfo.activate = FB_ACTIVATE_NOW;
-	vinfo.accel_flags = 0;	/* Temporarily reserve registers */
-	vinfo.bits_per_pixel = 16;
-	vinfo.xres = pScrn->virtualX;
-	vinfo.xres_virtual = pScrn->virtualX;
-	vinfo.yres = pScrn->virtualY;
-	vinfo.yres_virtual = pScrn->virtualX;
-	vinfo.xoffset = 0;
-	vinfo.yoffset = 0;
-	vinfo.red.length = vinfo.red.offset = 0;
-	vinfo.green.length = vinfo.green.offset = 0;
-	vinfo.blue.length = vinfo.blue.offset = 0;
-	vinfo.transp.length = vinfo.transp.offset = 0;
-
-	ioctl(pCube->console_fd, FBIOPUT_VSCREENINFO, &vinfo);
+  if (!CUBEFbMap(pScrn))
+    goto fail;
 
-	
-  return 1;
+  /* find out on first use */
+  pFb->canBlank = TRUE;
+
+  /* see whether we can pace ourselves to the vertical retrace */
+  pCube->HaveVSync = ioctl(pFb->fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+  pCube->LastVBlank = CUBETime();
+  return TRUE;
+
+fail:
+  close(pFb->fd);
+  pFb->fd = -1;
+  return FALSE;
 }
-//static void GC_UpdateRectRGB16(_THIS, SDL_Rect * rect, int pitch)
-static void CUBERefreshArea(ScrnInfoPtr pScrn, int num, BoxPtr pbox)
+
+static void
+CUBEFbClose(CUBEPtr pCube)
 {
-   CUBEPtr pCube = CUBEPTR(pScrn);
-
-	int width, height, left, i, mod, mod32;
-	u8 *src, *dst;
-	u32 *src32, *dst32;
-	u16 *rgb;
-
-   if (pCube->Blanked) return;
-
-	/* XXX case width < 2 needs special treatment */
- while(num--)
- {
-	/* in pixel units */
- 	   left = pbox->x1 & ~1;	/* 2 pixel align */
-	   width = (pbox->x2 + 1) & ~1;	/* 2 pixel align in excess */
-	   height = pbox->y2-pbox->y1;
-
-	/* in bytes, src and dest are 16bpp */
-//	src = _this->hidden->buffer + (rect->y * pitch) + left * 2;
-        src=pCube->ShadowPtr + (pbox->y1 * pCube->ShadowPitch) + 
-            (left * 2);
-	      dst = pCube->mapped_mem + (pbox->y1 * pCube->ShadowPitch) + left * 2;
-	      mod = pCube->ShadowPitch - width * 2;
-
-	      src32 = (u32 *) src;
-	      dst32 = (u32 *) dst;
-	      mod32 = mod / 4;
-
-	      while (height--) {
-		        i = width / 2;
-
-		        while (i--) {
-			            rgb = (u16 *) src32;
-			            *dst32++ = rgbrgb16toyuy2(rgb[0], rgb[1]);
-			            src32++;
-		        }
-           dst32 += mod32;
-		       src32 += mod32;
-        }
-        pbox++;
-   }
+  CUBEFbPtr pFb = &pCube->Fb;
+
+  if (pFb->fd < 0)
+    return;
+  CUBEFbUnmap(pFb);
+  close(pFb->fd);
+  pFb->fd = -1;
 }
 
 /*
- * CUBEDisplayPowerManagementSet --
- *
- * Sets VESA Display Power Management Signaling (DPMS) Mode.
+ * Make sure the framebuffer is in our mode. Usually it still is (we are just
+ * back from a VT switch or DPMS off) and this costs two ioctls; the mode is
+ * only set when it differs, and the framebuffer only remapped when that moved
+ * or resized it.
  */
-static void
-CUBEDisplayPowerManagementSet(ScrnInfoPtr pScrn, int PowerManagementMode,
-                               int flags)
+static Bool
+CUBEFbSetMode(ScrnInfoPtr pScrn)
 {
   CUBEPtr pCube = CUBEPTR(pScrn);
-  static int oldmode = -1;
+  CUBEFbPtr pFb = &pCube->Fb;
+  struct fb_var_screeninfo vinfo;
+  struct fb_fix_screeninfo finfo;
+  int pages = pCube->DoubleBuffer ? 2 : 1;
 
-#if 0
-  ErrorF("CUBEDisplayPowerManagementSet: %d\n", PowerManagementMode);
-#endif
+again:
+  if (ioctl(pFb->fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Couldn't get console pixel format\n");
+    return FALSE;
+  }
 
-  if (oldmode == DPMSModeOff && PowerManagementMode != DPMSModeOff)
-  {
-    CUBEModeInit(pScrn, pScrn->currentMode);
+  if (vinfo.bits_per_pixel != 16 ||
+      vinfo.xres != pScrn->virtualX || vinfo.yres != pScrn->virtualY ||
+      vinfo.xres_virtual != pScrn->virtualX ||
+      vinfo.yres_virtual != pScrn->virtualY * pages ||
+      vinfo.xoffset != 0 || vinfo.yoffset != 0) {
+    vinfo.activate = FB_ACTIVATE_NOW;
+    vinfo.accel_flags = 0;	/* Temporarily reserve registers */
+    vinfo.bits_per_pixel = 16;
+    vinfo.xres = pScrn->virtualX;
+    vinfo.xres_virtual = pScrn->virtualX;
+    vinfo.yres = pScrn->virtualY;
+    vinfo.yres_virtual = pScrn->virtualY * pages;
+    vinfo.xoffset = 0;
+    vinfo.yoffset = 0;
+    vinfo.red.length = vinfo.red.offset = 0;
+    vinfo.green.length = vinfo.green.offset = 0;
+    vinfo.blue.length = vinfo.blue.offset = 0;
+    vinfo.transp.length = vinfo.transp.offset = 0;
+
+    if (ioctl(pFb->fd, FBIOPUT_VSCREENINFO, &vinfo) < 0) {
+      if (pages > 1) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "No room for a second page, not double buffering\n");
+        pages = 1;
+        goto again;
+      }
+      xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Couldn't set a %dx%d mode\n",
+                 pScrn->virtualX, pScrn->virtualY);
+      return FALSE;
+    }
   }
+  pFb->vinfo = vinfo;
 
-  switch (PowerManagementMode)
-  {
-  case DPMSModeOn:
-    /* Screen: On; HSync: On, VSync: On */
-    pCube->Blanked = FALSE;
-    CUBERefreshAll(pScrn);
-    break;
-  case DPMSModeStandby:
-  case DPMSModeSuspend:
-    pCube->Blanked = TRUE;
-    memset(pCube->mapped_mem,0,pCube->mapped_memlen);
-    break;
-  case DPMSModeOff:
-    CUBERestore(pScrn, FALSE);
+  if (ioctl(pFb->fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Couldn't get console hardware info\n");
+    return FALSE;
+  }
+  if (finfo.smem_start != pFb->finfo.smem_start ||
+      finfo.smem_len != pFb->finfo.smem_len) {
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Framebuffer moved, remapping\n");
+    CUBEFbUnmap(pFb);
+    pFb->finfo = finfo;
+    if (!CUBEFbMap(pScrn))
+      return FALSE;
+  }
+  pFb->finfo = finfo;
+
+  /* the hardware pitch needn't be ours, older kernels don't even say */
+  pFb->pitch = finfo.line_length ? finfo.line_length : vinfo.xres_virtual * 2;
+  if (pFb->pitch < pScrn->virtualX * 2 ||
+      pFb->pitch * pScrn->virtualY * pages > pFb->memlen) {
+    if (pages > 1) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "No room for a second page, not double buffering\n");
+      pages = 1;
+      goto again;
+    }
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+               "A %dx%d screen doesn't fit the framebuffer\n",
+               pScrn->virtualX, pScrn->virtualY);
+    return FALSE;
+  }
+
+  pFb->pages = pages;
+  pFb->front = 0;
+  pFb->pageSize = pFb->pitch * pScrn->virtualY;
+  return TRUE;
+}
+
+/*
+ * Show the page the last flush drew. FB_ACTIVATE_VBL has the kernel latch the
+ * new offset at the next retrace; if it can't pan at all we copy the back
+ * page over and carry on single buffered.
+ */
+static void
+CUBEFbFlip(ScrnInfoPtr pScrn)
+{
+  CUBEFbPtr pFb = &CUBEPTR(pScrn)->Fb;
+  int back = pFb->front ^ 1;
+
+  pFb->vinfo.xoffset = 0;
+  pFb->vinfo.yoffset = back * pScrn->virtualY;
+  pFb->vinfo.activate = FB_ACTIVATE_VBL;
+  if (ioctl(pFb->fd, FBIOPAN_DISPLAY, &pFb->vinfo) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "Page flipping failed, not double buffering\n");
+    /* page 0 is still on screen, give it what we drew */
+    if (back != 0)
+      memcpy(CUBE_FB_PAGE(pFb, 0), CUBE_FB_PAGE(pFb, back), pFb->pageSize);
+    pFb->pages = 1;
+    pFb->front = 0;
+    return;
+  }
+  pFb->front = back;
+}
+
+/* Monotonic enough for pacing; wraps every ~71 minutes, compare with (s32) */
+static u32
+CUBETime(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* What Stats and FrameBudget time flushes with: the timebase where there is one */
+#if defined(__powerpc__)
+#define CUBE_TICKS_UNIT "timebase ticks"
+
+static inline u32
+CUBETicks(void)
+{
+  u32 tb;
+
+  __asm__ __volatile__("mftb %0" : "=r"(tb));
+  return tb;
+}
+#else
+#define CUBE_TICKS_UNIT "usecs"
+#define CUBETicks() CUBETime()
+#endif
+
+/* for FrameBudget, which is given in usecs */
+static u32
+CUBETicksPerMsec(void)
+{
+#if defined(__powerpc__)
+  u32 start, ticks;
+
+  start = CUBETime();
+  ticks = CUBETicks();
+  usleep(10000);
+  ticks = CUBETicks() - ticks;
+  return (unsigned long long) ticks * 1000 / MAX(CUBETime() - start, 1);
+#else
+  return 1000;
+#endif
+}
+
+/*
+ * Stats. There is one report per screen every StatsInterval seconds, and
+ * one whenever the server gets a SIGUSR2; each covers the time since the
+ * previous one. The signal handler only counts requests, the reports are
+ * logged from the block handler.
+ */
+static volatile int CUBEStatsRequests;
+static int CUBEStatsScreens;
+static OsSigHandlerPtr CUBEStatsSaved;
+
+static void
+CUBEStatsSignal(int sig)
+{
+  CUBEStatsRequests++;
+}
+
+/* percent of a out of b */
+#define CUBE_PERCENT(a, b) ((b) ? (unsigned) ((a) * 100 / (b)) : 0)
+
+static void
+CUBEStatsReport(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBEStatsRec c = pCube->Counters;
+
+  memset(&pCube->Counters, 0, sizeof(pCube->Counters));
+
+  xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+             "Stats: %u flushes, %u boxes, %llu rows converted, "
+             "%llu unchanged, %llu unchanged tiles\n",
+             c.flushes, c.boxes, c.rows, c.rowsSame, c.tilesSame);
+  xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+             "Stats: %llu pixels converted (%u%% black, %u%% in pairs of "
+             "one colour, %u%% in runs), %llu KiB written\n",
+             c.pixels, CUBE_PERCENT(c.black, c.pixels),
+             CUBE_PERCENT(c.equal, c.pixels), CUBE_PERCENT(c.run, c.pixels),
+             c.bytes >> 10);
+  xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+             "Stats: %u " CUBE_TICKS_UNIT " per flush, %u at most, "
+             "%u bands carried over\n",
+             c.flushes ? c.ticks / c.flushes : 0, c.ticksMax, c.carried);
+}
+
+static CARD32
+CUBEStatsTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+  ScrnInfoPtr pScrn = arg;
+
+  CUBEStatsReport(pScrn);
+  return CUBEPTR(pScrn)->StatsInterval * 1000;
+}
+
+static void
+CUBEStatsBlockHandler(pointer data, pointer pTimeout, pointer pReadmask)
+{
+  ScrnInfoPtr pScrn = data;
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  int requests = CUBEStatsRequests;
+
+  if (pCube->StatsDumps == requests)
+    return;
+  pCube->StatsDumps = requests;
+  CUBEStatsReport(pScrn);
+}
+
+static void
+CUBEStatsInit(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  memset(&pCube->Counters, 0, sizeof(pCube->Counters));
+  pCube->StatsDumps = CUBEStatsRequests;
+  if (!RegisterBlockAndWakeupHandlers(CUBEStatsBlockHandler,
+                                      (WakeupHandlerProcPtr) NoopDDA, pScrn)) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "Stats: couldn't register a block handler, SIGUSR2 ignored\n");
+  } else if (!CUBEStatsScreens++) {
+    CUBEStatsSaved = OsSignal(SIGUSR2, CUBEStatsSignal);
+  }
+
+  if (pCube->StatsInterval)
+    pCube->StatsTimer = TimerSet(pCube->StatsTimer, 0,
+                                 pCube->StatsInterval * 1000,
+                                 CUBEStatsTimer, pScrn);
+}
+
+static void
+CUBEStatsClose(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  if (!pCube->Stats)
+    return;
+  if (pCube->StatsTimer) {
+    TimerFree(pCube->StatsTimer);
+    pCube->StatsTimer = NULL;
+  }
+  RemoveBlockAndWakeupHandlers(CUBEStatsBlockHandler,
+                               (WakeupHandlerProcPtr) NoopDDA, pScrn);
+  if (CUBEStatsScreens && !--CUBEStatsScreens)
+    OsSignal(SIGUSR2, CUBEStatsSaved);
+}
+
+/*
+ * Pick the span converter and the write strategy: those named by Options
+ * "Converter" and "WriteStrategy", or else the fastest at turning a
+ * synthetic 640x480 frame into YUY2 straight in the framebuffer, since the
+ * uncached stores are a good part of the cost. Only converters of the
+ * Option "Chroma" quality are considered, and of the screen's depth.
+ */
+#define CUBE_BENCH_RUNS 3
+
+static const char *CUBEStrategyNames[] = { "direct", "staged" };
+
+/* by CUBE_CHROMA_* */
+static const char *CUBEChromaNames[] = { "fast", "average", "dither" };
+
+static u32
+CUBETimeConverter(ScrnInfoPtr pScrn, const CUBEConverterRec *conv, Bool staged,
+                  int width, int height)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  u32 start, elapsed = ~0;
+  u32 *dst32, *src32;
+  int run, y;
+
+  cube_convert_rows(&pCube->Convert, conv, width / 2);
+  for (run = 0; run < CUBE_BENCH_RUNS; run++) {
+    start = CUBETime();
+    for (y = 0; y < height; y++) {
+      dst32 = (u32 *) (pCube->Fb.mem + y * pCube->Fb.pitch);
+      src32 = (u32 *) (pCube->ShadowPtr + y * pCube->ShadowPitch);
+      cube_dither_row(&pCube->Convert, y);
+      if (staged)
+        cube_convert_staged(&pCube->Convert, conv, dst32, src32, width / 2);
+      else
+        cube_convert_runs(&pCube->Convert, conv, dst32, src32, width / 2);
+    }
+    elapsed = MIN(elapsed, CUBETime() - start);
+  }
+  xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+             "Converter \"%s\", %s writes: %u usecs per %dx%d frame\n",
+             conv->name, CUBEStrategyNames[staged], (unsigned)elapsed,
+             width, height);
+  return elapsed;
+}
+
+static void
+CUBESelectConverter(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  const CUBEConverterRec *conv, *best, *named = NULL;
+  char *name;
+  u16 *pix;
+  u32 *pix32, pixel;
+  u32 seed = 1, elapsed, bestTime;
+  int width, height, x, y, staged, first = 0, last = 1;
+  int chroma = CUBE_CHROMA_FAST;
+  Bool bestStaged = FALSE;
+
+  name = xf86GetOptValString(pCube->Options, OPTION_CHROMA);
+  if (name) {
+    for (chroma = CUBE_CHROMA_DITHER; chroma > CUBE_CHROMA_FAST; chroma--)
+      if (!xf86NameCmp(name, CUBEChromaNames[chroma]))
+        break;
+    if (chroma == CUBE_CHROMA_FAST && xf86NameCmp(name, "fast"))
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "Chroma \"%s\" unknown, using \"fast\"\n", name);
+    else
+      xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Chroma: %s\n",
+                 CUBEChromaNames[chroma]);
+  }
+  for (conv = CUBEConverters; conv->name; conv++)
+    if (conv->depth == pScrn->depth && conv->chroma == chroma)
+      break;
+  if (!conv->name) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "No %s chroma at depth %d, using \"fast\"\n",
+               CUBEChromaNames[chroma], pScrn->depth);
+    chroma = CUBE_CHROMA_FAST;
+  }
+
+  name = xf86GetOptValString(pCube->Options, OPTION_CONVERTER);
+  if (name && xf86NameCmp(name, "auto")) {
+    for (conv = CUBEConverters; conv->name; conv++) {
+      if (conv->depth == pScrn->depth && conv->chroma == chroma &&
+          !xf86NameCmp(name, conv->name) && (!conv->setup || conv->setup())) {
+        named = conv;
+        break;
+      }
+    }
+    if (!named)
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "Converter \"%s\" unknown or unavailable, picking the fastest\n", name);
+  }
+
+  name = xf86GetOptValString(pCube->Options, OPTION_WRITE_STRATEGY);
+  if (name && !xf86NameCmp(name, "direct"))
+    last = 0;
+  else if (name && !xf86NameCmp(name, "staged"))
+    first = 1;
+  else if (name && xf86NameCmp(name, "auto"))
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "WriteStrategy \"%s\" unknown, picking the fastest\n", name);
+
+  if (named && first == last) {
+    pCube->Converter = named;
+    pCube->Staged = first;
+    cube_convert_rows(&pCube->Convert, named, pScrn->virtualX / 2);
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+               "Using the \"%s\" converter, %s writes\n",
+               named->name, CUBEStrategyNames[first]);
+    return;
+  }
+
+  width = MIN(pCube->ShadowWidth, 640) & ~1;
+  height = MIN(pCube->ShadowHeight, 480);
+
+  /* a bit of everything: black, solid fills and noise */
+  for (y = 0; y < height; y++) {
+    pix = (u16 *) (pCube->ShadowPtr + y * pCube->ShadowPitch);
+    pix32 = (u32 *) pix;
+    for (x = 0; x < width; x++) {
+      switch ((x / 64 + y / 48) % 3) {
+      case 0:
+        pixel = 0x0000;
+        break;
+      case 1:
+        pixel = pCube->ShadowBpp == 4 ? 0xc0c0c0 : 0xc618;
+        break;
+      default:
+        seed = seed * 1103515245 + 12345;
+        pixel = pCube->ShadowBpp == 4 ? seed & 0xffffff : seed >> 16;
+        break;
+      }
+      if (pCube->ShadowBpp == 4)
+        pix32[x] = pixel;
+      else
+        pix[x] = pixel;
+    }
+  }
+
+  best = NULL;
+  bestTime = ~0;
+  for (conv = named ? named : CUBEConverters; conv->name; conv++) {
+    if (conv->depth != pScrn->depth || conv->chroma != chroma)
+      continue;
+    if (conv != named && conv->setup && !conv->setup()) {
+      xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                 "Converter \"%s\" unavailable\n", conv->name);
+      continue;
+    }
+    for (staged = first; staged <= last; staged++) {
+      elapsed = CUBETimeConverter(pScrn, conv, staged, width, height);
+      if (!best || elapsed < bestTime) {
+        if (best && best != conv && best->release)
+          best->release();
+        best = conv;
+        bestStaged = staged;
+        bestTime = elapsed;
+      }
+    }
+    if (best != conv && conv->release)
+      conv->release();
+    if (named)
+      break;
+  }
+
+  pCube->Converter = best;
+  pCube->Staged = bestStaged;
+  /* the row kernel for whole framebuffer rows, if best has one */
+  cube_convert_rows(&pCube->Convert, best, pScrn->virtualX / 2);
+  xf86DrvMsg(pScrn->scrnIndex, named ? X_CONFIG : X_PROBED,
+             "Using the \"%s\" converter, %s writes\n",
+             best->name, CUBEStrategyNames[bestStaged]);
+
+  /*
+   * leave the screen as blank as CUBEModeInit() did, and the shadow as empty
+   * as CUBEShadowAlloc() did, which a capture's reset record says it is
+   */
+  for (y = 0; y < height; y++)
+    memset(pCube->ShadowPtr + y * pCube->ShadowPitch, 0,
+           width * pCube->ShadowBpp);
+  CUBEFbClear(&pCube->Fb);
+  CUBEDamageInvalidate(&pCube->Damage);
+}
+
+/*
+ * Stats: which of the converters' fast paths the pairs about to be converted
+ * take. That is a pass of its own rather than counters in the converters,
+ * which are left alone when nobody looks.
+ */
+static void
+CUBEStatsClassify(CUBEPtr pCube, const u32 *src32, int pairs)
+{
+  CUBEStatsPtr pStats = &pCube->Counters;
+  u32 black = 0, equal = 0, rgb1, rgb2;
+  int i;
+
+  for (i = 0; i < pairs; i++) {
+    if (pCube->ShadowBpp == 2) {
+      rgb1 = src32[i] >> 16;
+      rgb2 = src32[i] & 0xffff;
+    } else {
+      rgb1 = src32[2 * i] & 0xffffff;
+      rgb2 = src32[2 * i + 1] & 0xffffff;
+    }
+    if (!(rgb1 | rgb2))
+      black++;
+    else if (rgb1 == rgb2)
+      equal++;
+  }
+  pStats->black += black * 2;
+  pStats->equal += equal * 2;
+}
+
+/*
+ * ShadowScale: every shadow pixel is repeated ShadowScale times into a row,
+ * which is converted once, into memory, and then streamed out to each of
+ * the ShadowScale framebuffer rows. Repeated pixels make pairs of one
+ * colour, which all the converters take a fast path for.
+ */
+static int
+CUBEConvertScaled(CUBEPtr pCube, u32 *dst32, const u32 *src32, int pairs)
+{
+  int scale = pCube->ShadowScale;
+  int n = pairs * 2, i, k, run;
+  /* at the offset into a burst that dst32 has */
+  u32 *line = pCube->ScaleLine + ((unsigned long) dst32 & (CUBE_BURST - 1)) / 4;
+
+  if (pCube->ShadowBpp == 2) {
+    const u16 *p = (const u16 *) src32;
+    u16 *q = (u16 *) pCube->ScaleSrc;
+    for (i = 0; i < n; i++)
+      for (k = 0; k < scale; k++)
+        *q++ = p[i];
+  } else {
+    u32 *q = pCube->ScaleSrc;
+    for (i = 0; i < n; i++)
+      for (k = 0; k < scale; k++)
+        *q++ = src32[i];
+  }
+
+  run = cube_convert_runs(&pCube->Convert, pCube->Converter, line,
+                          pCube->ScaleSrc, pairs * scale);
+  for (k = 0; k < scale; k++)
+    cube_stream32((u32 *) ((u8 *) dst32 + k * pCube->Fb.pitch), line,
+                  pairs * scale);
+  return run / scale;
+}
+
+static void
+CUBEConvertRuns(CUBEPtr pCube, u32 *dst32, const u32 *src32, int pairs)
+{
+  pCube->Counters.pixels += pairs * 2;
+  pCube->Counters.bytes += pairs * 4 * pCube->ShadowScale * pCube->ShadowScale;
+  if (pCube->Stats)
+    CUBEStatsClassify(pCube, src32, pairs);
+
+  if (pCube->ShadowScale > 1)
+    pCube->Counters.run += CUBEConvertScaled(pCube, dst32, src32, pairs);
+  else if (pCube->Staged)
+    pCube->Counters.run += cube_convert_staged(&pCube->Convert, pCube->Converter,
+                                               dst32, src32, pairs);
+  else
+    pCube->Counters.run += cube_convert_runs(&pCube->Convert, pCube->Converter,
+                                             dst32, src32, pairs);
+}
+
+/* CUBEDamageWalk() hands over [x1, x2) of shadow row y to be converted */
+static void
+CUBEFlushConvert(void *arg, int y, int x1, int x2)
+{
+  CUBEPtr pCube = arg;
+  CUBECursorPtr pCur = pCube->Cursor;
+  int scale = pCube->ShadowScale;
+  u32 *dst32 = (u32 *) (CUBE_FB_DRAW(&pCube->Fb) + y * scale * pCube->Fb.pitch);
+
+  cube_dither_row(&pCube->Convert, y * scale);
+  CUBEConvertRuns(pCube, dst32 + x1 * scale / 2,
+                  (u32 *) (pCube->ShadowPtr + y * pCube->ShadowPitch +
+                           x1 * pCube->ShadowBpp), (x2 - x1) / 2);
+
+  /* that may have painted over the pointer */
+  if (pCur && y >= pCur->box.y1 && y < pCur->box.y2)
+    pCur->redraw = TRUE;
+}
+
+/* Page flipping: [x1, x2) of row y as the front page shows it, to the back */
+static void
+CUBEFlushCopy(void *arg, int y, int x1, int x2)
+{
+  CUBEPtr pCube = arg;
+  CUBEFbPtr pFb = &pCube->Fb;
+  int scale = pCube->ShadowScale;
+  int k;
+
+  for (k = 0; k < scale; k++)
+    memcpy(CUBE_FB_DRAW(pFb) + (y * scale + k) * pFb->pitch + x1 * scale * 2,
+           CUBE_FB_PAGE(pFb, pFb->front) + (y * scale + k) * pFb->pitch +
+           x1 * scale * 2,
+           (x2 - x1) * scale * 2);
+  pCube->Counters.bytes += (x2 - x1) * scale * scale * 2;
+}
+
+/*
+ * Convert everything accumulated so far, or with a budget what fits, see
+ * CUBEDamageWalk(). When page flipping that is into the back page; the
+ * caller flips.
+ */
+static void
+CUBEDamageFlush(CUBEPtr pCube, u32 budget)
+{
+  CUBECursorPtr pCur = pCube->Cursor;
+  unsigned long long pixels = pCube->Counters.pixels;
+  CUBEFlushRec flush;
+  u32 start = 0;
+
+  if (pCube->Stats || budget)
+    start = CUBETicks();
+
+  /* may add damage, where the pointer was */
+  if (pCur)
+    CUBECursorPrepare(pCube);
+
+  memset(&flush, 0, sizeof(flush));
+  flush.shadow = pCube->ShadowPtr;
+  flush.pitch = pCube->ShadowPitch;
+  flush.bpp = pCube->ShadowBpp;
+  flush.convert = CUBEFlushConvert;
+  flush.copy = pCube->Fb.pages > 1 ? CUBEFlushCopy : NULL;
+  flush.arg = pCube;
+  flush.pixelCost = pCube->PixelCost;
+  /* FrameBudget: a pointer's size around the pointer goes first */
+  if (pCur && pCur->box.x1 < pCur->box.x2) {
+    flush.nearX1 = pCur->box.x1 - CUBE_CURSOR_SIZE;
+    flush.nearY1 = pCur->box.y1 - CUBE_CURSOR_SIZE;
+    flush.nearX2 = pCur->box.x2 + CUBE_CURSOR_SIZE;
+    flush.nearY2 = pCur->box.y2 + CUBE_CURSOR_SIZE;
+  }
+
+  CUBEDamageWalk(&pCube->Damage, &flush, budget);
+  pCube->Counters.rows += flush.rows;
+  pCube->Counters.rowsSame += flush.rowsSame;
+  pCube->Counters.tilesSame += flush.tilesSame;
+  pCube->Counters.carried += flush.carried;
+
+  if (pCur)
+    CUBECursorFinish(pCube, CUBE_FB_DRAW(&pCube->Fb));
+
+  pCube->Counters.flushes++;
+  if (!pCube->Stats && !budget)
+    return;
+  start = CUBETicks() - start;
+  if (budget)
+    pCube->PixelCost = CUBEDamageCost(pCube->PixelCost, start,
+                                      pCube->Counters.pixels - pixels);
+  if (pCube->Stats) {
+    pCube->Counters.ticks += start;
+    pCube->Counters.ticksMax = MAX(pCube->Counters.ticksMax, start);
+  }
+}
+
+/*
+ * CaptureFile. Every batch of damage, as it comes in and before it is
+ * queued or converted, goes to the trace with the pixels it covers, for
+ * cube_replay to play through the converters and flush policies later. The
+ * file is only ever written by X; a failed write stops the capture.
+ */
+static void
+CUBECaptureOpen(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBETraceHeader hdr;
+  const char *file;
+
+  file = xf86GetOptValString(pCube->Options, OPTION_CAPTURE_FILE);
+  if (!file)
+    return;
+  pCube->Capture = fopen(file, "wb");
+  if (!pCube->Capture) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "CaptureFile: can't create %s, not capturing\n", file);
+    return;
+  }
+
+  hdr.magic = CUBE_TRACE_MAGIC;
+  hdr.version = CUBE_TRACE_VERSION;
+  hdr.depth = pScrn->depth;
+  hdr.bpp = pScrn->bitsPerPixel;
+  hdr.width = pCube->ShadowWidth;
+  hdr.height = pCube->ShadowHeight;
+  hdr.scale = pCube->ShadowScale;
+  fwrite(&hdr, sizeof(hdr), 1, pCube->Capture);
+  xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Capturing damage to %s\n", file);
+}
+
+/* The part of a box inside the shadow */
+static void
+CUBECaptureClip(CUBEPtr pCube, BoxPtr pbox, CUBETraceBox *box)
+{
+  box->x1 = MIN(MAX(pbox->x1, 0), pCube->ShadowWidth);
+  box->y1 = MIN(MAX(pbox->y1, 0), pCube->ShadowHeight);
+  box->x2 = MIN(MAX(pbox->x2, box->x1), pCube->ShadowWidth);
+  box->y2 = MIN(MAX(pbox->y2, box->y1), pCube->ShadowHeight);
+}
+
+/* A batch of more boxes than a record counts goes in several records */
+#define CUBE_CAPTURE_MAX_BOXES 0xffff
+
+static void
+CUBECaptureRecord(ScrnInfoPtr pScrn, CUBETraceType type, int num, BoxPtr pbox)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBETraceRecord rec;
+  CUBETraceBox box;
+  int i, n, y;
+
+  if (!pCube->Capture || (type == CUBE_TRACE_DAMAGE && !num))
+    return;
+
+  rec.type = type;
+  rec.time = CUBETime();
+  do {
+    n = MIN(num, CUBE_CAPTURE_MAX_BOXES);
+    rec.boxes = n;
+    fwrite(&rec, sizeof(rec), 1, pCube->Capture);
+    for (i = 0; i < n; i++) {
+      CUBECaptureClip(pCube, &pbox[i], &box);
+      fwrite(&box, sizeof(box), 1, pCube->Capture);
+    }
+    for (i = 0; i < n; i++) {
+      CUBECaptureClip(pCube, &pbox[i], &box);
+      if (box.x1 == box.x2)
+        continue;
+      for (y = box.y1; y < box.y2; y++)
+        fwrite(pCube->ShadowPtr + y * pCube->ShadowPitch +
+               box.x1 * pCube->ShadowBpp,
+               (box.x2 - box.x1) * pCube->ShadowBpp, 1, pCube->Capture);
+    }
+    pbox += n;
+    num -= n;
+  } while (num > 0);
+
+  if (ferror(pCube->Capture)) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "CaptureFile: write failed, capture stopped\n");
+    fclose(pCube->Capture);
+    pCube->Capture = NULL;
+  }
+}
+
+static void CUBERefreshArea(ScrnInfoPtr pScrn, int num, BoxPtr pbox)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  CUBECaptureRecord(pScrn, CUBE_TRACE_DAMAGE, num, pbox);
+  /* while blanked too, for CUBEBlank() to convert when unblanking */
+  pCube->Counters.boxes += num;
+#ifdef CUBE_THREADS
+  if (pCube->Threaded) {
+    CUBEWorkerPost(pCube, num, pbox);
+    return;
+  }
+#endif
+
+  while (num--) {
+    CUBEDamageAdd(&pCube->Damage, pbox->x1, pbox->y1, pbox->x2, pbox->y2);
+    pbox++;
+  }
+  if (pCube->Blanked)
+    return;
+  CUBEDamageFlush(pCube, 0);
+  if (pCube->Fb.pages > 1)
+    CUBEFbFlip(pScrn);
+}
+
+/*
+ * DirectPutImage. Clients streaming video or emulator frames PutImage (plain
+ * or through MIT-SHM) the better part of a screen at a time; fb would copy
+ * all of it into the shadow and ShadowFB then have us convert all of it,
+ * reading back a frame that fell out of the cache long ago. Large images
+ * copied straight to a visible, unclipped window at the screen's depth are
+ * instead copied and converted a band of CUBE_BAND bytes at a time, still
+ * in the cache when converted. The shadow gets the pixels as usual, as
+ * everything else still draws there and reads from it.
+ *
+ * The GC layer this takes sits above ShadowFB and Damage, and only cares
+ * for PutImage; the rest of it is the usual wrapping. What it writes itself
+ * is reported to Damage by hand, before writing, so that XDamage clients
+ * hear of it and misprite takes a software cursor out of the way first.
+ */
+typedef struct {
+  GCOps*              ops;        /* NULL on pixmaps, not wrapped */
+  GCFuncs*            funcs;
+} CUBEGCRec, *CUBEGCPtr;
+
+static int CUBEGCIndex = -1;
+static int CUBEGCGeneration = 0;
+
+#define CUBE_GC_PRIV(pGC) ((CUBEGCPtr) (pGC)->devPrivates[CUBEGCIndex].ptr)
+
+static GCFuncs CUBEGCFuncs;
+static GCOps CUBEGCOps;
+
+#define CUBE_GC_FUNC_PROLOGUE(pGC) \
+  CUBEGCPtr pPriv = CUBE_GC_PRIV(pGC); \
+  (pGC)->funcs = pPriv->funcs; \
+  if (pPriv->ops) \
+    (pGC)->ops = pPriv->ops
+
+#define CUBE_GC_FUNC_EPILOGUE(pGC) \
+  pPriv->funcs = (pGC)->funcs; \
+  (pGC)->funcs = &CUBEGCFuncs; \
+  if (pPriv->ops) { \
+    pPriv->ops = (pGC)->ops; \
+    (pGC)->ops = &CUBEGCOps; \
+  }
+
+#define CUBE_GC_OP_PROLOGUE(pGC) \
+  CUBEGCPtr pPriv = CUBE_GC_PRIV(pGC); \
+  GCFuncs *oldFuncs = (pGC)->funcs; \
+  (pGC)->funcs = pPriv->funcs; \
+  (pGC)->ops = pPriv->ops
+
+#define CUBE_GC_OP_EPILOGUE(pGC) \
+  pPriv->ops = (pGC)->ops; \
+  (pGC)->funcs = oldFuncs; \
+  (pGC)->ops = &CUBEGCOps
+
+/*
+ * Copy and convert the image if it qualifies, see above. Anything else, and
+ * whatever is small enough for a single band anyway, is left to fb.
+ */
+static Bool
+CUBEPutImageDirect(DrawablePtr pDraw, GCPtr pGC, int depth, int x, int y,
+                   int w, int h, int leftPad, int format, char *pImage)
+{
+  ScreenPtr pScreen = pDraw->pScreen;
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  RegionPtr pClip = fbGetCompositeClip(pGC);
+  int bpp = pCube->ShadowBpp;
+  int stride, rows, x1, y1, x2, y2;
+  BoxPtr pExt;
+  BoxRec band;
+  RegionRec damage;
+  u8 *src, *dst;
+
+  if (!pScrn->vtSema || format != ZPixmap || depth != pDraw->depth ||
+      leftPad || pGC->alu != GXcopy ||
+      (pGC->planemask & FbFullMask(depth)) != FbFullMask(depth))
+    return FALSE;
+
+  if (w <= 0 || h <= 0)
+    return FALSE;
+  rows = MAX(CUBE_BAND / (w * bpp), 1);
+  if (h <= rows)
+    return FALSE;
+
+  /* redirected windows draw into pixmaps of their own */
+  if ((*pScreen->GetWindowPixmap)((WindowPtr) pDraw) !=
+      (*pScreen->GetScreenPixmap)(pScreen))
+    return FALSE;
+
+  x1 = pDraw->x + x;
+  y1 = pDraw->y + y;
+  x2 = x1 + w;
+  y2 = y1 + h;
+  if (REGION_NUM_RECTS(pClip) != 1)
+    return FALSE;
+  pExt = REGION_RECTS(pClip);
+  if (x1 < pExt->x1 || y1 < pExt->y1 || x2 > pExt->x2 || y2 > pExt->y2)
+    return FALSE;
+
+  band.x1 = x1;
+  band.y1 = y1;
+  band.x2 = x2;
+  band.y2 = y2;
+  REGION_INIT(pScreen, &damage, &band, 1);
+  DamageDamageRegion(pDraw, &damage);
+  REGION_UNINIT(pScreen, &damage);
+
+  stride = PixmapBytePad(w, depth);
+  src = (u8 *) pImage;
+  dst = pCube->ShadowPtr + y1 * pCube->ShadowPitch + x1 * bpp;
+  band.x1 = x1;
+  band.x2 = x2;
+  for (band.y1 = y1; band.y1 < y2; band.y1 = band.y2) {
+    band.y2 = MIN(band.y1 + rows, y2);
+    for (y = band.y1; y < band.y2; y++) {
+      memcpy(dst, src, w * bpp);
+      src += stride;
+      dst += pCube->ShadowPitch;
+    }
+    CUBERefreshArea(pScrn, 1, &band);
+  }
+  return TRUE;
+}
+
+static void
+CUBEGCPutImage(DrawablePtr pDraw, GCPtr pGC, int depth, int x, int y,
+               int w, int h, int leftPad, int format, char *pImage)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  if (!CUBEPutImageDirect(pDraw, pGC, depth, x, y, w, h, leftPad, format,
+                          pImage))
+    (*pGC->ops->PutImage)(pDraw, pGC, depth, x, y, w, h, leftPad, format,
+                          pImage);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCFillSpans(DrawablePtr pDraw, GCPtr pGC, int n, DDXPointPtr ppt,
+                int *pwidth, int fSorted)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->FillSpans)(pDraw, pGC, n, ppt, pwidth, fSorted);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCSetSpans(DrawablePtr pDraw, GCPtr pGC, char *psrc, DDXPointPtr ppt,
+               int *pwidth, int n, int fSorted)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->SetSpans)(pDraw, pGC, psrc, ppt, pwidth, n, fSorted);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static RegionPtr
+CUBEGCCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC, int srcx,
+               int srcy, int w, int h, int dstx, int dsty)
+{
+  RegionPtr ret;
+  CUBE_GC_OP_PROLOGUE(pGC);
+  ret = (*pGC->ops->CopyArea)(pSrc, pDst, pGC, srcx, srcy, w, h, dstx, dsty);
+  CUBE_GC_OP_EPILOGUE(pGC);
+  return ret;
+}
+
+static RegionPtr
+CUBEGCCopyPlane(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC, int srcx,
+                int srcy, int w, int h, int dstx, int dsty, unsigned long plane)
+{
+  RegionPtr ret;
+  CUBE_GC_OP_PROLOGUE(pGC);
+  ret = (*pGC->ops->CopyPlane)(pSrc, pDst, pGC, srcx, srcy, w, h, dstx, dsty,
+                               plane);
+  CUBE_GC_OP_EPILOGUE(pGC);
+  return ret;
+}
+
+static void
+CUBEGCPolyPoint(DrawablePtr pDraw, GCPtr pGC, int mode, int npt,
+                DDXPointPtr ppt)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyPoint)(pDraw, pGC, mode, npt, ppt);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolylines(DrawablePtr pDraw, GCPtr pGC, int mode, int npt,
+                DDXPointPtr ppt)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->Polylines)(pDraw, pGC, mode, npt, ppt);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolySegment(DrawablePtr pDraw, GCPtr pGC, int nseg, xSegment *pSeg)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolySegment)(pDraw, pGC, nseg, pSeg);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolyRectangle(DrawablePtr pDraw, GCPtr pGC, int nrects,
+                    xRectangle *pRects)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyRectangle)(pDraw, pGC, nrects, pRects);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolyArc(DrawablePtr pDraw, GCPtr pGC, int narcs, xArc *parcs)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyArc)(pDraw, pGC, narcs, parcs);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCFillPolygon(DrawablePtr pDraw, GCPtr pGC, int shape, int mode, int count,
+                  DDXPointPtr pts)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->FillPolygon)(pDraw, pGC, shape, mode, count, pts);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolyFillRect(DrawablePtr pDraw, GCPtr pGC, int nrects,
+                   xRectangle *pRects)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyFillRect)(pDraw, pGC, nrects, pRects);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolyFillArc(DrawablePtr pDraw, GCPtr pGC, int narcs, xArc *parcs)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyFillArc)(pDraw, pGC, narcs, parcs);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static int
+CUBEGCPolyText8(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+                char *chars)
+{
+  int ret;
+  CUBE_GC_OP_PROLOGUE(pGC);
+  ret = (*pGC->ops->PolyText8)(pDraw, pGC, x, y, count, chars);
+  CUBE_GC_OP_EPILOGUE(pGC);
+  return ret;
+}
+
+static int
+CUBEGCPolyText16(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+                 unsigned short *chars)
+{
+  int ret;
+  CUBE_GC_OP_PROLOGUE(pGC);
+  ret = (*pGC->ops->PolyText16)(pDraw, pGC, x, y, count, chars);
+  CUBE_GC_OP_EPILOGUE(pGC);
+  return ret;
+}
+
+static void
+CUBEGCImageText8(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+                 char *chars)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->ImageText8)(pDraw, pGC, x, y, count, chars);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCImageText16(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+                  unsigned short *chars)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->ImageText16)(pDraw, pGC, x, y, count, chars);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCImageGlyphBlt(DrawablePtr pDraw, GCPtr pGC, int x, int y,
+                    unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->ImageGlyphBlt)(pDraw, pGC, x, y, nglyph, ppci, pglyphBase);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPolyGlyphBlt(DrawablePtr pDraw, GCPtr pGC, int x, int y,
+                   unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PolyGlyphBlt)(pDraw, pGC, x, y, nglyph, ppci, pglyphBase);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDraw, int w, int h,
+                 int x, int y)
+{
+  CUBE_GC_OP_PROLOGUE(pGC);
+  (*pGC->ops->PushPixels)(pGC, pBitMap, pDraw, w, h, x, y);
+  CUBE_GC_OP_EPILOGUE(pGC);
+}
+
+/* by name, as servers differ in what follows PushPixels */
+static GCOps CUBEGCOps = {
+  .FillSpans = CUBEGCFillSpans,
+  .SetSpans = CUBEGCSetSpans,
+  .PutImage = CUBEGCPutImage,
+  .CopyArea = CUBEGCCopyArea,
+  .CopyPlane = CUBEGCCopyPlane,
+  .PolyPoint = CUBEGCPolyPoint,
+  .Polylines = CUBEGCPolylines,
+  .PolySegment = CUBEGCPolySegment,
+  .PolyRectangle = CUBEGCPolyRectangle,
+  .PolyArc = CUBEGCPolyArc,
+  .FillPolygon = CUBEGCFillPolygon,
+  .PolyFillRect = CUBEGCPolyFillRect,
+  .PolyFillArc = CUBEGCPolyFillArc,
+  .PolyText8 = CUBEGCPolyText8,
+  .PolyText16 = CUBEGCPolyText16,
+  .ImageText8 = CUBEGCImageText8,
+  .ImageText16 = CUBEGCImageText16,
+  .ImageGlyphBlt = CUBEGCImageGlyphBlt,
+  .PolyGlyphBlt = CUBEGCPolyGlyphBlt,
+  .PushPixels = CUBEGCPushPixels,
+};
+
+/* only drawing to windows can reach the screen */
+static void
+CUBEGCValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDraw)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGC);
+  (*pGC->funcs->ValidateGC)(pGC, changes, pDraw);
+  pPriv->ops = pDraw->type == DRAWABLE_WINDOW ? pGC->ops : NULL;
+  CUBE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCChangeGC(GCPtr pGC, unsigned long mask)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGC);
+  (*pGC->funcs->ChangeGC)(pGC, mask);
+  CUBE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCCopyGC(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGCDst);
+  (*pGCDst->funcs->CopyGC)(pGCSrc, mask, pGCDst);
+  CUBE_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static void
+CUBEGCDestroyGC(GCPtr pGC)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGC);
+  (*pGC->funcs->DestroyGC)(pGC);
+  CUBE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCChangeClip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGC);
+  (*pGC->funcs->ChangeClip)(pGC, type, pvalue, nrects);
+  CUBE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCDestroyClip(GCPtr pGC)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGC);
+  (*pGC->funcs->DestroyClip)(pGC);
+  CUBE_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+CUBEGCCopyClip(GCPtr pGCDst, GCPtr pGCSrc)
+{
+  CUBE_GC_FUNC_PROLOGUE(pGCDst);
+  (*pGCDst->funcs->CopyClip)(pGCDst, pGCSrc);
+  CUBE_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static GCFuncs CUBEGCFuncs = {
+  CUBEGCValidateGC, CUBEGCChangeGC, CUBEGCCopyGC, CUBEGCDestroyGC,
+  CUBEGCChangeClip, CUBEGCDestroyClip, CUBEGCCopyClip
+};
+
+static Bool
+CUBECreateGC(GCPtr pGC)
+{
+  ScreenPtr pScreen = pGC->pScreen;
+  CUBEPtr pCube = CUBEPTR(xf86Screens[pScreen->myNum]);
+  CUBEGCPtr pPriv = CUBE_GC_PRIV(pGC);
+  Bool ret;
+
+  pScreen->CreateGC = pCube->CreateGC;
+  ret = (*pScreen->CreateGC)(pGC);
+  if (ret) {
+    pPriv->ops = NULL;
+    pPriv->funcs = pGC->funcs;
+    pGC->funcs = &CUBEGCFuncs;
+  }
+  pScreen->CreateGC = CUBECreateGC;
+  return ret;
+}
+
+static Bool
+CUBEGCInit(ScreenPtr pScreen)
+{
+  CUBEPtr pCube = CUBEPTR(xf86Screens[pScreen->myNum]);
+
+  if (CUBEGCGeneration != serverGeneration) {
+    if ((CUBEGCIndex = AllocateGCPrivateIndex()) < 0)
+      return FALSE;
+    CUBEGCGeneration = serverGeneration;
+  }
+  if (!AllocateGCPrivate(pScreen, CUBEGCIndex, sizeof(CUBEGCRec)))
+    return FALSE;
+
+  pCube->CreateGC = pScreen->CreateGC;
+  pScreen->CreateGC = CUBECreateGC;
+  return TRUE;
+}
+
+/*
+ * DeferredUpdate. The shadow layer hands us the damage accumulated since the
+ * last block handler; we only queue it and convert once per display refresh,
+ * from a timer aimed just before the next vertical retrace. When the kernel
+ * implements FBIO_WAITFORVSYNC the timer then waits for the retrace itself,
+ * otherwise the timer alone paces us.
+ *
+ * With DoubleBuffer the order is the other way round: we convert into the
+ * back page ahead of the retrace (the timer fires early enough, going by how
+ * long the last flushes took), then wait for it and flip.
+ */
+#define CUBE_VSYNC_MARGIN 2000	/* usecs we aim ahead of the retrace */
+
+static CARD32
+CUBEFlushTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+  ScrnInfoPtr pScrn = arg;
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  pCube->FlushPending = FALSE;
+
+  if (pCube->Blanked)
+    return 0;
+  CUBEFrameFlush(pScrn);
+  /* FrameBudget left some for the next frame */
+  if (pCube->Damage.y1 < pCube->Damage.y2)
+    CUBEScheduleFlush(pScrn);
+  return 0;
+}
+
+/* The flush of one frame, due CUBEFlushDelay() from now */
+static void
+CUBEFrameFlush(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  u32 crtc = 0, start;
+  Bool flipping;
+
+  flipping = pCube->Fb.pages > 1;
+  if (flipping) {
+    start = CUBETime();
+    CUBEDamageFlush(pCube, pCube->FrameBudget);
+    pCube->FlushCost = (pCube->FlushCost * 3 + (CUBETime() - start)) / 4;
+  }
+
+  if (pCube->HaveVSync &&
+      ioctl(pCube->Fb.fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "FBIO_WAITFORVSYNC failed, falling back to timer pacing\n");
+    pCube->HaveVSync = FALSE;
+  }
+  pCube->LastVBlank = CUBETime();
+
+  if (flipping)
+    CUBEFbFlip(pScrn);
+  else
+    CUBEDamageFlush(pCube, pCube->FrameBudget);
+}
+
+/* usecs until the next frame's flush should start */
+static s32
+CUBEFlushDelay(CUBEPtr pCube)
+{
+  u32 now, next;
+  s32 delay;
+
+  /* next retrace, assuming they kept coming since the last one we saw */
+  now = CUBETime();
+  next = pCube->LastVBlank + pCube->FramePeriod;
+  if ((s32)(now - next) > 0)
+    next += ((now - next) / pCube->FramePeriod + 1) * pCube->FramePeriod;
+  delay = (s32)(next - now);
+  if (pCube->HaveVSync)
+    delay -= CUBE_VSYNC_MARGIN;
+  if (pCube->Fb.pages > 1)
+    delay -= pCube->FlushCost;
+  return delay;
+}
+
+static void
+CUBEScheduleFlush(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  s32 delay;
+
+  if (pCube->FlushPending)
+    return;
+
+  delay = CUBEFlushDelay(pCube);
+  pCube->FlushTimer = TimerSet(pCube->FlushTimer, 0,
+                               delay > 1000 ? delay / 1000 : 1,
+                               CUBEFlushTimer, pScrn);
+  pCube->FlushPending = TRUE;
+}
+
+static void
+CUBEShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  RegionPtr damage = shadowDamage(pBuf);
+  int num = REGION_NUM_RECTS(damage);
+  BoxPtr pbox = REGION_RECTS(damage);
+
+  CUBECaptureRecord(pScrn, CUBE_TRACE_DAMAGE, num, pbox);
+  pCube->Counters.boxes += num;
+#ifdef CUBE_THREADS
+  if (pCube->Threaded) {
+    CUBEWorkerPost(pCube, num, pbox);
+    return;
+  }
+#endif
+
+  while (num--) {
+    CUBEDamageAdd(&pCube->Damage, pbox->x1, pbox->y1, pbox->x2, pbox->y2);
+    pbox++;
+  }
+  if (!pCube->Blanked)
+    CUBEScheduleFlush(pScrn);
+}
+
+static Bool
+CUBECreateScreenResources(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  Bool ret;
+
+  pScreen->CreateScreenResources = pCube->CreateScreenResources;
+  ret = pScreen->CreateScreenResources(pScreen);
+  pScreen->CreateScreenResources = CUBECreateScreenResources;
+
+  if (!ret)
+    return FALSE;
+
+  return shadowAdd(pScreen, pScreen->GetScreenPixmap(pScreen),
+                   CUBEShadowUpdate, NULL, 0, NULL);
+}
+
+#ifdef CUBE_THREADS
+/*
+ * Threaded. Everything the thread reads besides the ring (Blanked, the
+ * framebuffer session, the accumulator) is only changed by X between
+ * CUBEWorkerPause() and CUBEWorkerResume(), so the two never need to lock
+ * around drawing. The shadow itself is read while X keeps drawing into it;
+ * a box is only posted once its drawing is done, so a half drawn area
+ * converted early is converted again.
+ */
+
+/* X side: queue boxes for the thread, repainting everything if it lags */
+static void
+CUBEWorkerPost(CUBEPtr pCube, int num, BoxPtr pbox)
+{
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+  unsigned head = pWorker->head;
+
+  while (num--) {
+    if (head - pWorker->tail == CUBE_RING_SIZE) {
+      pWorker->overflow = TRUE;
+      break;
+    }
+    pWorker->ring[head & (CUBE_RING_SIZE - 1)] = *pbox++;
+    head++;
+  }
+  __sync_synchronize();		/* the boxes before the new head */
+  pWorker->head = head;
+  sem_post(&pWorker->wake);
+}
+
+/* Thread side: fold whatever was posted into the accumulator */
+static void
+CUBEWorkerDrain(CUBEPtr pCube)
+{
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+  unsigned head = pWorker->head, tail = pWorker->tail;
+  BoxPtr pbox;
+
+  __sync_synchronize();		/* the new head before the boxes */
+  for (; tail != head; tail++) {
+    pbox = &pWorker->ring[tail & (CUBE_RING_SIZE - 1)];
+    CUBEDamageAdd(&pCube->Damage, pbox->x1, pbox->y1, pbox->x2, pbox->y2);
+  }
+  __sync_synchronize();		/* done with the slots before X reuses them */
+  pWorker->tail = tail;
+
+  if (__sync_lock_test_and_set(&pWorker->overflow, 0))
+    CUBEDamageAdd(&pCube->Damage, 0, 0,
+                  pCube->Damage.width, pCube->Damage.height);
+}
+
+static void *
+CUBEWorkerMain(void *arg)
+{
+  ScrnInfoPtr pScrn = arg;
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+  s32 delay;
+  Bool quit;
+
+  for (;;) {
+    while (sem_wait(&pWorker->wake) < 0)
+      ;
+
+    pthread_mutex_lock(&pWorker->lock);
+    if (pWorker->state == CUBE_WORKER_PAUSE) {
+      pWorker->state = CUBE_WORKER_PAUSED;
+      pthread_cond_broadcast(&pWorker->cond);
+      while (pWorker->state == CUBE_WORKER_PAUSED)
+        pthread_cond_wait(&pWorker->cond, &pWorker->lock);
+    }
+    quit = pWorker->state == CUBE_WORKER_QUIT;
+    pthread_mutex_unlock(&pWorker->lock);
+    if (quit)
+      break;
+
+    CUBEWorkerDrain(pCube);
+    if (pCube->Blanked)
+      continue;		/* the damage keeps until unblanking */
+    if (pCube->Damage.y1 >= pCube->Damage.y2 && !CUBECursorChanged(pCube))
+      continue;
+
+    if (!pCube->Deferred) {
+      CUBEDamageFlush(pCube, 0);
+      continue;
+    }
+
+    /* same pacing as CUBEFlushTimer(), only we may simply sleep */
+    delay = CUBEFlushDelay(pCube);
+    if (delay > 0)
+      usleep(delay);
+    CUBEWorkerDrain(pCube);
+    CUBEFrameFlush(pScrn);
+    /* FrameBudget left some for the next frame */
+    if (pCube->Damage.y1 < pCube->Damage.y2)
+      sem_post(&pWorker->wake);
+  }
+  return NULL;
+}
+
+static Bool
+CUBEWorkerStart(ScrnInfoPtr pScrn)
+{
+  CUBEWorkerPtr pWorker = &CUBEPTR(pScrn)->Worker;
+  sigset_t all, old;
+  int err;
+
+  pWorker->paused = 0;
+  pWorker->state = CUBE_WORKER_RUN;
+  pWorker->head = pWorker->tail = 0;
+  pWorker->overflow = FALSE;
+  if (sem_init(&pWorker->wake, 0, 0) < 0)
+    return FALSE;
+  pthread_mutex_init(&pWorker->lock, NULL);
+  pthread_cond_init(&pWorker->cond, NULL);
+
+  /* the server's signals (input, timers) must keep going to the server */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&pWorker->thread, NULL, CUBEWorkerMain, pScrn);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err) {
+    pthread_cond_destroy(&pWorker->cond);
+    pthread_mutex_destroy(&pWorker->lock);
+    sem_destroy(&pWorker->wake);
+    return FALSE;
+  }
+  pWorker->running = TRUE;
+  return TRUE;
+}
+
+static void
+CUBEWorkerStop(CUBEPtr pCube)
+{
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+
+  if (!pWorker->running)
+    return;
+
+  pthread_mutex_lock(&pWorker->lock);
+  pWorker->state = CUBE_WORKER_QUIT;
+  pthread_cond_broadcast(&pWorker->cond);
+  pthread_mutex_unlock(&pWorker->lock);
+  sem_post(&pWorker->wake);
+  pthread_join(pWorker->thread, NULL);
+
+  pthread_cond_destroy(&pWorker->cond);
+  pthread_mutex_destroy(&pWorker->lock);
+  sem_destroy(&pWorker->wake);
+  pWorker->running = FALSE;
+  /* anything still queued is picked up by the next CUBERepaintStart() */
+}
+
+/*
+ * Park the thread between flushes, so X may touch the framebuffer and the
+ * accumulator itself. Waits at most for the flush in progress. Nests.
+ */
+static void
+CUBEWorkerPause(CUBEPtr pCube)
+{
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+
+  if (!pWorker->running || pWorker->paused++)
+    return;
+
+  pthread_mutex_lock(&pWorker->lock);
+  pWorker->state = CUBE_WORKER_PAUSE;
+  sem_post(&pWorker->wake);
+  while (pWorker->state != CUBE_WORKER_PAUSED)
+    pthread_cond_wait(&pWorker->cond, &pWorker->lock);
+  pthread_mutex_unlock(&pWorker->lock);
+}
+
+static void
+CUBEWorkerResume(CUBEPtr pCube)
+{
+  CUBEWorkerPtr pWorker = &pCube->Worker;
+
+  if (!pWorker->running || --pWorker->paused)
+    return;
+
+  pthread_mutex_lock(&pWorker->lock);
+  pWorker->state = CUBE_WORKER_RUN;
+  pthread_cond_broadcast(&pWorker->cond);
+  pthread_mutex_unlock(&pWorker->lock);
+  /* whatever was posted meanwhile */
+  sem_post(&pWorker->wake);
+}
+#endif
+
+/*
+ * CUBEDisplayPowerManagementSet --
+ *
+ * Sets VESA Display Power Management Signaling (DPMS) Mode.
+ */
+static void
+CUBEDisplayPowerManagementSet(ScrnInfoPtr pScrn, int PowerManagementMode,
+                               int flags)
+{
+#if 0
+  ErrorF("CUBEDisplayPowerManagementSet: %d\n", PowerManagementMode);
+#endif
+
+  switch (PowerManagementMode)
+  {
+  case DPMSModeOn:
+    /* Screen: On; HSync: On, VSync: On */
+    CUBEBlank(pScrn, FB_BLANK_UNBLANK);
+    break;
+  case DPMSModeStandby:
+    CUBEBlank(pScrn, FB_BLANK_VSYNC_SUSPEND);
+    break;
+  case DPMSModeSuspend:
+    CUBEBlank(pScrn, FB_BLANK_HSYNC_SUSPEND);
     break;
+  case DPMSModeOff:
+    CUBEBlank(pScrn, FB_BLANK_POWERDOWN);
+    break;
+  }
+}
+
+
+/* Get whatever damage there is converted, the way new damage would be */
+static void
+CUBEKickFlush(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+#ifdef CUBE_THREADS
+  if (pCube->Threaded) {
+    CUBEWorkerPost(pCube, 0, NULL);
+    return;
   }
-  oldmode = PowerManagementMode;
+#endif
+  if (pCube->Deferred)
+    CUBEScheduleFlush(pScrn);
+  else
+    CUBERefreshArea(pScrn, 0, NULL);
 }
 
+/*
+ * Repainting. After a mode set (entering the VT included) or a blanking that
+ * cleared the screen, the framebuffer is black and the shadow has the whole
+ * picture. Rather than converting all of it before X gets going again, a
+ * timer hands it over as damage, CUBE_REPAINT_ROWS rows at a time from the
+ * top, whenever no other flush is waiting; drawing meanwhile gets converted
+ * first, and at most one band's worth of conversion sits in its way.
+ */
+#define CUBE_REPAINT_ROWS	(CUBE_TILE * 3)
+#define CUBE_REPAINT_INTERVAL	1	/* msecs between bands, and retries */
 
-static void
-CUBERefreshAll(ScrnInfoPtr pScrn)
+static CARD32
+CUBERepaintTimer(OsTimerPtr timer, CARD32 now, pointer arg)
 {
+  ScrnInfoPtr pScrn = arg;
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  Bool busy = pCube->FlushPending;
   BoxRec box;
+
+  /* carried on by CUBERepaintResume() when unblanking */
+  if (!pCube->CubeInitiated || pCube->Blanked ||
+      pCube->RepaintY >= pCube->ShadowHeight)
+    return 0;
+#ifdef CUBE_THREADS
+  if (pCube->Threaded)
+    busy = pCube->Worker.head != pCube->Worker.tail;
+#endif
+  if (busy)
+    return CUBE_REPAINT_INTERVAL;
+
   box.x1 = 0;
-  box.x2 = 640;
-  box.y1 = 0;
-  box.y2 = 480;
-  CUBERefreshArea(pScrn, 1, &box);
+  box.x2 = pCube->ShadowWidth;
+  box.y1 = pCube->RepaintY;
+  box.y2 = MIN(box.y1 + CUBE_REPAINT_ROWS, pCube->ShadowHeight);
+  pCube->RepaintY = box.y2;
+  if (pCube->Deferred && !pCube->Threaded) {
+    /* at the next retrace, like the drawing in CUBEShadowUpdate() */
+    CUBECaptureRecord(pScrn, CUBE_TRACE_DAMAGE, 1, &box);
+    CUBEDamageAdd(&pCube->Damage, box.x1, box.y1, box.x2, box.y2);
+    CUBEScheduleFlush(pScrn);
+  } else {
+    CUBERefreshArea(pScrn, 1, &box);
+  }
+
+  return pCube->RepaintY < pCube->ShadowHeight ? CUBE_REPAINT_INTERVAL : 0;
+}
+
+static void
+CUBERepaintStart(ScrnInfoPtr pScrn)
+{
+  CUBEPTR(pScrn)->RepaintY = 0;
+  CUBERepaintResume(pScrn);
+}
+
+static void
+CUBERepaintResume(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  if (pCube->RepaintY >= pCube->ShadowHeight)
+    return;
+  pCube->RepaintTimer = TimerSet(pCube->RepaintTimer, 0, CUBE_REPAINT_INTERVAL,
+                                 CUBERepaintTimer, pScrn);
+}
+
+/*
+ * Cursor. The xf86Cursor hooks only record what the pointer should look
+ * like and where; CUBECursorBlockHandler() then gets a flush going the way
+ * drawing would (right away, at the next retrace or by the conversion
+ * thread). The flush restores the areas the pointer left by converting
+ * them again, and composites the pointer over whatever it converted.
+ */
+#ifdef CUBE_THREADS
+#define CUBE_CURSOR_LOCK(pCube) \
+  do { if ((pCube)->Worker.running) pthread_mutex_lock(&(pCube)->Worker.lock); } while (0)
+#define CUBE_CURSOR_UNLOCK(pCube) \
+  do { if ((pCube)->Worker.running) pthread_mutex_unlock(&(pCube)->Worker.lock); } while (0)
+#else
+#define CUBE_CURSOR_LOCK(pCube) do { } while (0)
+#define CUBE_CURSOR_UNLOCK(pCube) do { } while (0)
+#endif
+
+#define CUBE_BOX_EQUAL(a, b) \
+  ((a).x1 == (b).x1 && (a).y1 == (b).y1 && (a).x2 == (b).x2 && (a).y2 == (b).y2)
+
+/* Where the pointer at x, y shows, pair aligned; empty when hidden */
+static void
+CUBECursorBox(CUBEPtr pCube, int x, int y, BoxPtr box)
+{
+  CUBECursorPtr pCur = pCube->Cursor;
+
+  box->x1 = box->y1 = box->x2 = box->y2 = 0;
+  if (!pCur->visible)
+    return;
+  box->x1 = MAX(x & ~1, 0);
+  box->x2 = MIN((x + CUBE_CURSOR_SIZE + 1) & ~1, pCube->Damage.width);
+  box->y1 = MAX(y, 0);
+  box->y2 = MIN(y + CUBE_CURSOR_SIZE, pCube->Damage.height);
+  if (box->x1 >= box->x2 || box->y1 >= box->y2)
+    box->x1 = box->y1 = box->x2 = box->y2 = 0;
+}
+
+/*
+ * Convert one image, given as x8r8g8b8 pixels with a coverage mask, for both
+ * phases. A pair the pointer covers entirely gets its chroma too, one it
+ * covers half only the covered pixel's luma.
+ */
+static void
+CUBECursorConvert(CUBECursorPtr pCur, const u32 *argb, const u8 *shown)
+{
+  int phase, row, pair, x;
+  u32 c1, c2;
+  u8 m;
+
+  for (phase = 0; phase < 2; phase++) {
+    for (row = 0; row < CUBE_CURSOR_SIZE; row++) {
+      for (pair = 0; pair < CUBE_CURSOR_PAIRS; pair++) {
+        x = pair * 2 - phase;
+        m = 0;
+        c1 = c2 = 0;
+        if (x >= 0 && x < CUBE_CURSOR_SIZE && shown[row * CUBE_CURSOR_SIZE + x]) {
+          m |= 1;
+          c1 = argb[row * CUBE_CURSOR_SIZE + x];
+        }
+        if (x + 1 >= 0 && x + 1 < CUBE_CURSOR_SIZE &&
+            shown[row * CUBE_CURSOR_SIZE + x + 1]) {
+          m |= 2;
+          c2 = argb[row * CUBE_CURSOR_SIZE + x + 1];
+        }
+        if (m == 1)
+          c2 = c1;
+        else if (m == 2)
+          c1 = c2;
+        pCur->mask[phase][row][pair] = m;
+        pCur->yuyv[phase][row][pair] = m ? rgbrgb32toyuy2(c1, c2) : 0;
+      }
+    }
+  }
+}
+
+/* The 2 colour image: source then mask plane, MSB first, 8 pixels a byte */
+static void
+CUBECursorConvertMono(CUBECursorPtr pCur)
+{
+  static u32 argb[CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE];
+  static u8 shown[CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE];
+  const u8 *source = pCur->bits;
+  const u8 *mask = pCur->bits + sizeof(pCur->bits) / 2;
+  int i, bit;
+
+  for (i = 0; i < CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE; i++) {
+    bit = 0x80 >> (i & 7);
+    shown[i] = (mask[i >> 3] & bit) != 0;
+    argb[i] = (source[i >> 3] & bit) ? pCur->fg : pCur->bg;
+  }
+  CUBECursorConvert(pCur, argb, shown);
+}
+
+static void
+CUBECursorBlockHandler(pointer data, pointer pTimeout, pointer pReadmask)
+{
+  ScrnInfoPtr pScrn = data;
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBECursorPtr pCur = pCube->Cursor;
+
+  if (!pCur->pending)
+    return;
+  pCur->pending = FALSE;
+
+  if (!pCube->Blanked)
+    CUBEKickFlush(pScrn);
+}
+
+static void
+CUBESetCursorColors(ScrnInfoPtr pScrn, int bg, int fg)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBECursorPtr pCur = pCube->Cursor;
+
+  CUBE_CURSOR_LOCK(pCube);
+  pCur->fg = fg;
+  pCur->bg = bg;
+  if (pCur->mono) {
+    CUBECursorConvertMono(pCur);
+    pCur->serial++;
+  }
+  CUBE_CURSOR_UNLOCK(pCube);
+  pCur->pending = TRUE;
+}
+
+/* Called from the SIGIO handler: no locks, no drawing */
+static void
+CUBESetCursorPosition(ScrnInfoPtr pScrn, int x, int y)
+{
+  CUBECursorPtr pCur = CUBEPTR(pScrn)->Cursor;
+
+  pCur->x = x;
+  pCur->y = y;
+  pCur->pending = TRUE;
+}
+
+static void
+CUBELoadCursorImage(ScrnInfoPtr pScrn, unsigned char *bits)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBECursorPtr pCur = pCube->Cursor;
+
+  CUBE_CURSOR_LOCK(pCube);
+  memcpy(pCur->bits, bits, sizeof(pCur->bits));
+  pCur->mono = TRUE;
+  CUBECursorConvertMono(pCur);
+  pCur->serial++;
+  CUBE_CURSOR_UNLOCK(pCube);
+  pCur->pending = TRUE;
+}
+
+static void
+CUBEHideCursor(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  CUBE_CURSOR_LOCK(pCube);
+  pCube->Cursor->visible = FALSE;
+  CUBE_CURSOR_UNLOCK(pCube);
+  pCube->Cursor->pending = TRUE;
+}
+
+static void
+CUBEShowCursor(ScrnInfoPtr pScrn)
+{
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  CUBE_CURSOR_LOCK(pCube);
+  pCube->Cursor->visible = TRUE;
+  CUBE_CURSOR_UNLOCK(pCube);
+  pCube->Cursor->pending = TRUE;
+}
+
+static Bool
+CUBEUseHWCursor(ScreenPtr pScreen, CursorPtr pCurs)
+{
+  return TRUE;
+}
+
+#ifdef ARGB_CURSOR
+static Bool
+CUBEUseHWCursorARGB(ScreenPtr pScreen, CursorPtr pCurs)
+{
+  return pCurs->bits->width <= CUBE_CURSOR_SIZE &&
+         pCurs->bits->height <= CUBE_CURSOR_SIZE;
+}
+
+/* No blending into YUY2: half transparent pixels are shown or not */
+static void
+CUBELoadCursorARGB(ScrnInfoPtr pScrn, CursorPtr pCurs)
+{
+  static u32 argb[CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE];
+  static u8 shown[CUBE_CURSOR_SIZE * CUBE_CURSOR_SIZE];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBECursorPtr pCur = pCube->Cursor;
+  const CARD32 *src = pCurs->bits->argb;
+  int w = pCurs->bits->width, h = pCurs->bits->height;
+  int x, y, i;
+
+  memset(shown, 0, sizeof(shown));
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      i = y * CUBE_CURSOR_SIZE + x;
+      argb[i] = src[y * w + x];
+      shown[i] = (argb[i] >> 24) >= 0x80;
+    }
+  }
+
+  CUBE_CURSOR_LOCK(pCube);
+  pCur->mono = FALSE;
+  CUBECursorConvert(pCur, argb, shown);
+  pCur->serial++;
+  CUBE_CURSOR_UNLOCK(pCube);
+  pCur->pending = TRUE;
+}
+#endif
+
+static Bool
+CUBECursorInit(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  xf86CursorInfoPtr infoPtr;
+
+  pCube->Cursor = xcalloc(1, sizeof(CUBECursorRec));
+  infoPtr = xf86CreateCursorInfoRec();
+  if (!pCube->Cursor || !infoPtr)
+    goto fail;
+
+  infoPtr->MaxWidth = CUBE_CURSOR_SIZE;
+  infoPtr->MaxHeight = CUBE_CURSOR_SIZE;
+  infoPtr->Flags = HARDWARE_CURSOR_BIT_ORDER_MSBFIRST |
+                   HARDWARE_CURSOR_AND_SOURCE_WITH_MASK |
+                   HARDWARE_CURSOR_TRUECOLOR_AT_8BPP;
+  infoPtr->SetCursorColors = CUBESetCursorColors;
+  infoPtr->SetCursorPosition = CUBESetCursorPosition;
+  infoPtr->LoadCursorImage = CUBELoadCursorImage;
+  infoPtr->HideCursor = CUBEHideCursor;
+  infoPtr->ShowCursor = CUBEShowCursor;
+  infoPtr->UseHWCursor = CUBEUseHWCursor;
+#ifdef ARGB_CURSOR
+  infoPtr->UseHWCursorARGB = CUBEUseHWCursorARGB;
+  infoPtr->LoadCursorARGB = CUBELoadCursorARGB;
+#endif
+
+  if (!RegisterBlockAndWakeupHandlers(CUBECursorBlockHandler,
+                                      (WakeupHandlerProcPtr) NoopDDA, pScrn))
+    goto fail;
+  if (!xf86InitCursor(pScreen, infoPtr)) {
+    RemoveBlockAndWakeupHandlers(CUBECursorBlockHandler,
+                                 (WakeupHandlerProcPtr) NoopDDA, pScrn);
+    goto fail;
+  }
+  pCube->CursorInfo = infoPtr;
+  return TRUE;
+
+fail:
+  if (infoPtr)
+    xf86DestroyCursorInfoRec(infoPtr);
+  xfree(pCube->Cursor);
+  pCube->Cursor = NULL;
+  return FALSE;
+}
+
+static void
+CUBECursorClose(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+
+  if (!pCube->Cursor)
+    return;
+  RemoveBlockAndWakeupHandlers(CUBECursorBlockHandler,
+                               (WakeupHandlerProcPtr) NoopDDA, pScrn);
+  xf86DestroyCursorInfoRec(pCube->CursorInfo);
+  pCube->CursorInfo = NULL;
+  xfree(pCube->Cursor);
+  pCube->Cursor = NULL;
+}
+
+/* Does the page the next flush draws show anything but the current pointer? */
+static Bool
+CUBECursorChanged(CUBEPtr pCube)
+{
+  CUBECursorPtr pCur = pCube->Cursor;
+  int back = pCube->Fb.pages > 1 ? pCube->Fb.front ^ 1 : 0;
+  BoxRec box;
+  Bool changed;
+
+  if (!pCur)
+    return FALSE;
+  CUBE_CURSOR_LOCK(pCube);
+  CUBECursorBox(pCube, pCur->x, pCur->y, &box);
+  changed = !CUBE_BOX_EQUAL(box, pCur->drawn[back]) ||
+            pCur->serial != pCur->drawnSerial[back];
+  CUBE_CURSOR_UNLOCK(pCube);
+  return changed;
+}
+
+/*
+ * Flush side, before converting: take a snapshot of the pointer and have any
+ * stale copy of it converted away. When flipping that includes the one on
+ * the front page, as parts of it may get copied forward.
+ */
+static void
+CUBECursorPrepare(CUBEPtr pCube)
+{
+  CUBECursorPtr pCur = pCube->Cursor;
+  CUBEFbPtr pFb = &pCube->Fb;
+  int back = pFb->pages > 1 ? pFb->front ^ 1 : 0;
+  BoxPtr old;
+  int page;
+
+  CUBE_CURSOR_LOCK(pCube);
+  pCur->boxX = pCur->x;
+  pCur->boxY = pCur->y;
+  CUBECursorBox(pCube, pCur->boxX, pCur->boxY, &pCur->box);
+  pCur->boxSerial = pCur->serial;
+  CUBE_CURSOR_UNLOCK(pCube);
+
+  for (page = 0; page < pFb->pages; page++) {
+    old = &pCur->drawn[page];
+    if (old->x1 >= old->x2 ||
+        (CUBE_BOX_EQUAL(*old, pCur->box) && pCur->drawnSerial[page] == pCur->boxSerial))
+      continue;
+    /* the shadow didn't change there, so make sure the hashes don't say so */
+    CUBEDamageForget(&pCube->Damage, old->y1, old->y2);
+    CUBEDamageAdd(&pCube->Damage, old->x1, old->y1, old->x2, old->y2);
+    if (page == back)
+      old->x1 = old->y1 = old->x2 = old->y2 = 0;
+  }
+
+  pCur->redraw = pFb->pages > 1 ||
+                 !CUBE_BOX_EQUAL(pCur->drawn[back], pCur->box) ||
+                 pCur->drawnSerial[back] != pCur->boxSerial;
+}
+
+/* Flush side, after converting: put the pointer on the page drawn */
+static void
+CUBECursorFinish(CUBEPtr pCube, u8 *page)
+{
+  CUBECursorPtr pCur = pCube->Cursor;
+  CUBEFbPtr pFb = &pCube->Fb;
+  int back = pFb->pages > 1 ? pFb->front ^ 1 : 0;
+  int phase, row, pair, x0, x, y;
+  const u32 *yuyv;
+  const u8 *mask;
+  u8 *dst;
+
+  if (!pCur->redraw || pCur->box.x1 >= pCur->box.x2)
+    return;
+
+  CUBE_CURSOR_LOCK(pCube);
+  phase = pCur->boxX & 1;
+  x0 = pCur->boxX - phase;
+  for (row = 0; row < CUBE_CURSOR_SIZE; row++) {
+    y = pCur->boxY + row;
+    if (y < pCur->box.y1 || y >= pCur->box.y2)
+      continue;
+    yuyv = pCur->yuyv[phase][row];
+    mask = pCur->mask[phase][row];
+    for (pair = 0; pair < CUBE_CURSOR_PAIRS; pair++) {
+      x = x0 + pair * 2;
+      if (!mask[pair] || x < pCur->box.x1 || x >= pCur->box.x2)
+        continue;
+      dst = page + y * pFb->pitch + x * 2;
+      pCube->Counters.bytes += mask[pair] == 3 ? 4 : 1;
+      if (mask[pair] == 3)
+        *(u32 *) dst = yuyv[pair];
+      else if (mask[pair] == 1)
+        dst[0] = yuyv[pair] >> 24;
+      else
+        dst[2] = yuyv[pair] >> 8;
+    }
+  }
+  CUBE_CURSOR_UNLOCK(pCube);
+
+  pCur->drawn[back] = pCur->box;
+  pCur->drawnSerial[back] = pCur->boxSerial;
+}
+
+#ifdef XvExtension
+/*
+ * Xv. The hardware scans out YUY2, so images are written straight into the
+ * framebuffer, clipped to the window and nearest neighbour scaled, never
+ * going through the shadow. The rows drawn no longer match the shadow, so
+ * their hashes are dropped and the areas a frame no longer covers are
+ * repainted from the shadow.
+ */
+#define CUBE_VIDEO_MAX_WIDTH  1024
+#define CUBE_VIDEO_MAX_HEIGHT 1024
+
+typedef struct {
+  RegionRec           clip;       /* where the last frame went */
+} CUBEPortPrivRec, *CUBEPortPrivPtr;
+
+static XF86VideoEncodingRec CUBEVideoEncodings[] = {
+  { 0, "XV_IMAGE", CUBE_VIDEO_MAX_WIDTH, CUBE_VIDEO_MAX_HEIGHT, {1, 1} }
+};
+
+static XF86VideoFormatRec CUBEVideoFormats[] = {
+  { 15, TrueColor },
+  { 16, TrueColor },
+  { 24, TrueColor }
+};
+
+static XF86ImageRec CUBEVideoImages[] = {
+  XVIMAGE_YUY2,
+  XVIMAGE_YV12,
+  XVIMAGE_I420
+};
+
+/* One line of YUY2, unscaled or picking the nearest source pair */
+static void
+cube_yuy2_line(u32 *dst32, const u8 *src, int pairs, u32 xpos, u32 xstep)
+{
+	if (xstep == 0x10000) {
+		memcpy(dst32, src + ((xpos >> 16) & ~1) * 2, pairs * 4);
+		return;
+	}
+	while (pairs--) {
+		*dst32++ = *(const u32 *)(src + ((xpos >> 16) & ~1) * 2);
+		xpos += xstep * 2;
+	}
+}
+
+/* One line from the three planes of YV12/I420, interleaved */
+static void
+cube_planar_line(u32 *dst32, const u8 *y, const u8 *u, const u8 *v,
+                 int pairs, u32 xpos, u32 xstep)
+{
+	int x;
+
+	if (xstep == 0x10000) {
+		x = (xpos >> 16) & ~1;
+		y += x;
+		u += x >> 1;
+		v += x >> 1;
+		for (; pairs >= 2; pairs -= 2) {
+			dst32[0] = ((u32)y[0] << 24) | (u[0] << 16) | (y[1] << 8) | v[0];
+			dst32[1] = ((u32)y[2] << 24) | (u[1] << 16) | (y[3] << 8) | v[1];
+			dst32 += 2;
+			y += 4;
+			u += 2;
+			v += 2;
+		}
+		if (pairs)
+			*dst32 = ((u32)y[0] << 24) | (u[0] << 16) | (y[1] << 8) | v[0];
+		return;
+	}
+	while (pairs--) {
+		x = (xpos >> 16) & ~1;
+		*dst32++ = ((u32)y[x] << 24) | (u[x >> 1] << 16) |
+		           (y[x + 1] << 8) | v[x >> 1];
+		xpos += xstep * 2;
+	}
+}
+
+/* Where in the image, in 16.16, the pair at screen column x starts */
+static u32
+CUBEVideoXPos(int x, int src_x, int drw_x, u32 xstep)
+{
+  return ((u32)src_x << 16) + (x > drw_x ? (x - drw_x) * xstep : 0);
+}
+
+/* Pairs of a line from whichever layout the image has */
+static void
+CUBEVideoPairs(u32 *dst32, int pairs, u32 xpos, u32 xstep,
+               const u8 *py, const u8 *pu, const u8 *pv)
+{
+  if (pu)
+    cube_planar_line(dst32, py, pu, pv, pairs, xpos, xstep);
+  else
+    cube_yuy2_line(dst32, py, pairs, xpos, xstep);
+}
+
+/* Have the shadow repaint whatever of pOld isn't in pNew (NULL for all) */
+static void
+CUBEVideoUncover(ScrnInfoPtr pScrn, RegionPtr pOld, RegionPtr pNew)
+{
+  ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  RegionRec uncovered;
+  BoxPtr pbox;
+  int num;
+
+  REGION_NULL(pScreen, &uncovered);
+  if (pNew)
+    REGION_SUBTRACT(pScreen, &uncovered, pOld, pNew);
+  else
+    REGION_COPY(pScreen, &uncovered, pOld);
+
+  num = REGION_NUM_RECTS(&uncovered);
+  if (num) {
+    pbox = REGION_EXTENTS(pScreen, &uncovered);
+    CUBEDamageForget(&pCube->Damage, pbox->y1, pbox->y2);
+    CUBERefreshArea(pScrn, num, REGION_RECTS(&uncovered));
+  }
+  REGION_UNINIT(pScreen, &uncovered);
+}
+
+static void
+CUBEStopVideo(ScrnInfoPtr pScrn, pointer data, Bool shutdown)
+{
+  ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+  CUBEPortPrivPtr pPriv = data;
+
+  CUBEVideoUncover(pScrn, &pPriv->clip, NULL);
+  REGION_EMPTY(pScreen, &pPriv->clip);
+}
+
+static int
+CUBESetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 value,
+                     pointer data)
+{
+  return BadMatch;
+}
+
+static int
+CUBEGetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 *value,
+                     pointer data)
+{
+  return BadMatch;
+}
+
+static void
+CUBEQueryBestSize(ScrnInfoPtr pScrn, Bool motion,
+                  short vid_w, short vid_h, short drw_w, short drw_h,
+                  unsigned int *p_w, unsigned int *p_h, pointer data)
+{
+  /* we scale to anything */
+  *p_w = drw_w;
+  *p_h = drw_h;
+}
+
+static int
+CUBEQueryImageAttributes(ScrnInfoPtr pScrn, int id,
+                         unsigned short *w, unsigned short *h,
+                         int *pitches, int *offsets)
+{
+  int size, tmp;
+
+  if (*w > CUBE_VIDEO_MAX_WIDTH)
+    *w = CUBE_VIDEO_MAX_WIDTH;
+  if (*h > CUBE_VIDEO_MAX_HEIGHT)
+    *h = CUBE_VIDEO_MAX_HEIGHT;
+
+  *w = (*w + 1) & ~1;
+  if (offsets)
+    offsets[0] = 0;
+
+  switch (id) {
+  case FOURCC_YV12:
+  case FOURCC_I420:
+    *h = (*h + 1) & ~1;
+    size = (*w + 3) & ~3;
+    if (pitches)
+      pitches[0] = size;
+    size *= *h;
+    if (offsets)
+      offsets[1] = size;
+    tmp = ((*w >> 1) + 3) & ~3;
+    if (pitches)
+      pitches[1] = pitches[2] = tmp;
+    tmp *= (*h >> 1);
+    size += tmp;
+    if (offsets)
+      offsets[2] = size;
+    size += tmp;
+    break;
+  case FOURCC_YUY2:
+  default:
+    size = *w << 1;
+    if (pitches)
+      pitches[0] = size;
+    size *= *h;
+    break;
+  }
+  return size;
+}
+
+static int
+CUBEPutImage(ScrnInfoPtr pScrn,
+             short src_x, short src_y, short drw_x, short drw_y,
+             short src_w, short src_h, short drw_w, short drw_h,
+             int id, unsigned char *buf, short width, short height,
+             Bool sync, RegionPtr clipBoxes, pointer data,
+             DrawablePtr pDraw)
+{
+  ScreenPtr pScreen = screenInfo.screens[pScrn->scrnIndex];
+  CUBEPtr pCube = CUBEPTR(pScrn);
+  CUBEPortPrivPtr pPriv = data;
+  CUBEFbPtr pFb = &pCube->Fb;
+  CUBECursorPtr pCur = pCube->Cursor;
+  BoxPtr pbox;
+  const u8 *py, *pu, *pv, *cu, *cv;
+  u8 *page, *line;
+  u32 xstep, half;
+  int num, pitch, cpitch, x1, x2, px1, px2, y1, y2, y, sy, n;
+  Bool covered = FALSE;
+
+  if (pCube->Blanked || src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0)
+    return Success;
+
+  /* the planes, laid out as CUBEQueryImageAttributes() said */
+  width = (width + 1) & ~1;
+  if (id == FOURCC_YV12 || id == FOURCC_I420) {
+    pitch = (width + 3) & ~3;
+    cpitch = ((width >> 1) + 3) & ~3;
+    pv = buf + pitch * ((height + 1) & ~1);
+    pu = pv + cpitch * (((height + 1) & ~1) >> 1);
+    if (id == FOURCC_I420) {
+      const u8 *t = pu;
+      pu = pv;
+      pv = t;
+    }
+  } else {
+    pitch = width << 1;
+    cpitch = 0;
+    pu = pv = NULL;
+  }
+  xstep = ((u32)src_w << 16) / drw_w;
+
+  CUBEWorkerPause(pCube);
+
+  for (n = 0; n < pFb->pages; n++) {
+    page = CUBE_FB_PAGE(pFb, n);
+    num = REGION_NUM_RECTS(clipBoxes);
+    pbox = REGION_RECTS(clipBoxes);
+    for (; num--; pbox++) {
+      x1 = MAX(MAX(pbox->x1, drw_x), 0);
+      x2 = MIN(MIN(pbox->x2, drw_x + drw_w), pScrn->virtualX);
+      y1 = MAX(MAX(pbox->y1, drw_y), 0);
+      y2 = MIN(MIN(pbox->y2, drw_y + drw_h), pScrn->virtualY);
+      if (x1 >= x2 || y1 >= y2)
+        continue;
+
+      /*
+       * whole pairs inside the clip; an odd column at either edge gets the
+       * luma of its half of the pair only, the way the pointer's odd phase
+       * does, and the other half is left to what is beside the window
+       */
+      px1 = (x1 + 1) & ~1;
+      px2 = x2 & ~1;
+
+      for (y = y1; y < y2; y++) {
+        sy = src_y + (y - drw_y) * src_h / drw_h;
+        py = buf + sy * pitch;
+        cu = pu ? pu + (sy >> 1) * cpitch : NULL;
+        cv = pv ? pv + (sy >> 1) * cpitch : NULL;
+        line = page + y * pFb->pitch;
+        if (x1 & 1) {
+          CUBEVideoPairs(&half, 1, CUBEVideoXPos(x1 - 1, src_x, drw_x, xstep),
+                         xstep, py, cu, cv);
+          line[x1 * 2] = ((u8 *) &half)[2];
+        }
+        if (px1 < px2)
+          CUBEVideoPairs((u32 *) line + px1 / 2, (px2 - px1) / 2,
+                         CUBEVideoXPos(px1, src_x, drw_x, xstep), xstep, py, cu, cv);
+        if (x2 & 1) {
+          CUBEVideoPairs(&half, 1, CUBEVideoXPos(x2 - 1, src_x, drw_x, xstep),
+                         xstep, py, cu, cv);
+          line[(x2 - 1) * 2] = ((u8 *) &half)[0];
+        }
+      }
+    }
+  }
+
+  pbox = REGION_EXTENTS(pScreen, clipBoxes);
+  CUBEDamageForget(&pCube->Damage, pbox->y1, pbox->y2);
+
+  /* the frame went over the pointer: no page shows it there any more */
+  for (n = 0; pCur && n < pFb->pages; n++) {
+    pbox = &pCur->drawn[n];
+    if (pbox->x1 < pbox->x2 &&
+        RECT_IN_REGION(pScreen, clipBoxes, pbox) != rgnOUT) {
+      pbox->x1 = pbox->y1 = pbox->x2 = pbox->y2 = 0;
+      covered = TRUE;
+    }
+  }
+
+  /* the window moved or got covered: give back what we left */
+  if (!REGION_EQUAL(pScreen, &pPriv->clip, clipBoxes)) {
+    CUBEVideoUncover(pScrn, &pPriv->clip, clipBoxes);
+    REGION_COPY(pScreen, &pPriv->clip, clipBoxes);
+  }
+
+  CUBEWorkerResume(pCube);
+  if (covered)
+    CUBEKickFlush(pScrn);
+  return Success;
+}
+
+static XF86VideoAdaptorPtr
+CUBESetupImageVideo(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  XF86VideoAdaptorPtr adapt;
+  CUBEPortPrivPtr pPriv;
+
+  adapt = xcalloc(1, sizeof(XF86VideoAdaptorRec) + sizeof(DevUnion) +
+                     sizeof(CUBEPortPrivRec));
+  if (!adapt)
+    return NULL;
+
+  adapt->type = XvWindowMask | XvInputMask | XvImageMask;
+  adapt->flags = 0;
+  adapt->name = "Cube YUY2 framebuffer";
+  adapt->nEncodings = 1;
+  adapt->pEncodings = CUBEVideoEncodings;
+  adapt->nFormats = sizeof(CUBEVideoFormats) / sizeof(CUBEVideoFormats[0]);
+  adapt->pFormats = CUBEVideoFormats;
+  adapt->nPorts = 1;
+  adapt->pPortPrivates = (DevUnion *) &adapt[1];
+  pPriv = (CUBEPortPrivPtr) &adapt->pPortPrivates[1];
+  adapt->pPortPrivates[0].ptr = (pointer) pPriv;
+  adapt->nAttributes = 0;
+  adapt->pAttributes = NULL;
+  adapt->nImages = sizeof(CUBEVideoImages) / sizeof(CUBEVideoImages[0]);
+  adapt->pImages = CUBEVideoImages;
+  adapt->PutVideo = NULL;
+  adapt->PutStill = NULL;
+  adapt->GetVideo = NULL;
+  adapt->GetStill = NULL;
+  adapt->StopVideo = CUBEStopVideo;
+  adapt->SetPortAttribute = CUBESetPortAttribute;
+  adapt->GetPortAttribute = CUBEGetPortAttribute;
+  adapt->QueryBestSize = CUBEQueryBestSize;
+  adapt->PutImage = CUBEPutImage;
+  adapt->QueryImageAttributes = CUBEQueryImageAttributes;
+
+  REGION_NULL(pScreen, &pPriv->clip);
+
+  CUBEPTR(pScrn)->VideoAdaptor = adapt;
+  return adapt;
 }
+
+static void
+CUBEInitVideo(ScreenPtr pScreen)
+{
+  ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+  XF86VideoAdaptorPtr *adaptors, *newAdaptors = NULL;
+  XF86VideoAdaptorPtr newAdaptor;
+  int num;
+
+  num = xf86XVListGenericAdaptors(pScrn, &adaptors);
+  newAdaptor = CUBESetupImageVideo(pScreen);
+  if (newAdaptor) {
+    if (!num) {
+      num = 1;
+      adaptors = &newAdaptor;
+    } else {
+      newAdaptors = xalloc((num + 1) * sizeof(XF86VideoAdaptorPtr));
+      if (newAdaptors) {
+        memcpy(newAdaptors, adaptors, num * sizeof(XF86VideoAdaptorPtr));
+        newAdaptors[num++] = newAdaptor;
+        adaptors = newAdaptors;
+      }
+    }
+  }
+
+  if (num)
+    xf86XVScreenInit(pScreen, adaptors, num);
+
+  xfree(newAdaptors);
+}
+
+static void
+CUBECloseVideo(ScreenPtr pScreen)
+{
+  CUBEPtr pCube = CUBEPTR(xf86Screens[pScreen->myNum]);
+  CUBEPortPrivPtr pPriv;
+
+  if (!pCube->VideoAdaptor)
+    return;
+  pPriv = pCube->VideoAdaptor->pPortPrivates[0].ptr;
+  REGION_UNINIT(pScreen, &pPriv->clip);
+  xfree(pCube->VideoAdaptor);
+  pCube->VideoAdaptor = NULL;
+}
+#endif
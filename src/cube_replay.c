@@ -0,0 +1,384 @@
+/*
+   cube_replay: play a trace from Option "CaptureFile" through the RGB to
+   YUY2 converters outside the X server.
+
+   The trace's damage is applied to a shadow of its own and converted into
+   ordinary memory, by every converter built into the driver for the trace's
+   depth (or those named), with both write strategies and each flush policy:
+
+     boxes    every box as it came, overlaps and all
+     batches  per batch, through the driver's damage accumulator, the way
+              a flush without DeferredUpdate sees it
+     frames   the same, but collected over a frame (-p usecs, going by the
+              trace's time stamps) and flushed once, as DeferredUpdate does;
+              with -b usecs under that FrameBudget
+
+   The accumulator is set up as the driver would: -c pixels is SpanCost, -t
+   turns on TileCache, and spans are widened to write gather bursts where
+   the rows allow it. The conversion time, flushes, pixels and bytes written
+   are reported for each, and for the accumulator the rows and tiles left
+   alone as their hash was unchanged and the bands FrameBudget put off.
+   Each replay has to end up with the picture a full conversion of the
+   final shadow gives, and the exit status says whether they all did.
+   ShadowScale traces are replayed unscaled, and page flipping isn't.
+
+   usage: cube_replay [-p usecs] [-b usecs] [-c pixels] [-t] trace
+                      [converter...]
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "cube_convert.h"
+#include "cube_trace.h"
+#include "cube_damage.h"
+
+typedef enum { BOXES, BATCHES, FRAMES, POLICIES } policy_t;
+
+static const char *policy_names[POLICIES] = { "boxes", "batches", "frames" };
+static const char *strategy_names[2] = { "direct", "staged" };
+
+static CUBETraceHeader hdr;
+static const u8 *trace, *trace_end;	/* the records, all of the file */
+static int spp;				/* shadow bytes per pixel */
+static u8 *shadow, *dst, *want;		/* at 4 and 2 bytes a pixel */
+static CUBEDamageRec damage;		/* the batches and frames accumulator */
+static CUBEFlushRec flush;
+static u32 period = 16667;		/* usecs, 60Hz */
+static u32 budget;			/* usecs, FrameBudget, 0 for none */
+static int span_cost = CUBE_SPAN_COST, tile_cache;
+static CUBEConvertCtx ctx;
+static int warned;			/* about a truncated trace */
+
+static struct {
+	u32 usecs;
+	unsigned long flushes, pixels, same, tiles, carried;
+} totals;
+
+/* What CUBEDamageWalk() hands over spans for */
+typedef struct {
+	int (*convert_row)(CUBEConvertCtx *, const CUBEConverterRec *,
+			   u32 *, const u32 *, int);
+	const CUBEConverterRec *conv;
+} replay_target;
+
+static u32
+replay_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+replay_load(const char *file)
+{
+	FILE *f;
+	long len;
+	u8 *buf;
+
+	f = fopen(file, "rb");
+	if (!f) {
+		perror(file);
+		exit(1);
+	}
+	if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < (long) sizeof(hdr) ||
+	    fseek(f, 0, SEEK_SET) < 0) {
+		fprintf(stderr, "cube_replay: %s is no trace\n", file);
+		exit(1);
+	}
+	buf = malloc(len);
+	if (!buf || fread(buf, len, 1, f) != 1) {
+		fprintf(stderr, "cube_replay: can't read %s\n", file);
+		exit(1);
+	}
+	fclose(f);
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != CUBE_TRACE_MAGIC || hdr.version != CUBE_TRACE_VERSION) {
+		fprintf(stderr, "cube_replay: %s is no trace of this version%s\n",
+			file, hdr.magic == 0x54425543u ? ", or of the other byte order" : "");
+		exit(1);
+	}
+	if ((hdr.bpp != 16 && hdr.bpp != 32) || hdr.width < 2 || hdr.width & 1 ||
+	    !hdr.height) {
+		fprintf(stderr, "cube_replay: %s has a %dx%d shadow at %d bpp\n",
+			file, hdr.width, hdr.height, hdr.bpp);
+		exit(1);
+	}
+	trace = buf + sizeof(hdr);
+	trace_end = buf + len;
+	spp = hdr.bpp / 8;
+}
+
+/* Convert a row's [x1, x2), widened to whole pairs */
+static void
+replay_span(int (*convert_row)(CUBEConvertCtx *, const CUBEConverterRec *,
+			       u32 *, const u32 *, int),
+	    const CUBEConverterRec *conv, int y, int x1, int x2)
+{
+	x1 &= ~1;
+	x2 = (x2 + 1) & ~1;
+	cube_dither_row(&ctx, y);
+	convert_row(&ctx, conv, (u32 *) (dst + (y * hdr.width + x1) * 2),
+		    (const u32 *) (shadow + (y * hdr.width + x1) * spp),
+		    (x2 - x1) / 2);
+	totals.pixels += x2 - x1;
+}
+
+static void
+replay_convert(void *arg, int y, int x1, int x2)
+{
+	replay_target *target = arg;
+
+	replay_span(target->convert_row, target->conv, y, x1, x2);
+}
+
+/* A flush of the accumulator, with FrameBudget going by what the last ones cost */
+static void
+replay_flush(u32 frame_budget)
+{
+	unsigned long pixels = totals.pixels;
+	u32 start;
+
+	if (damage.y1 >= damage.y2)
+		return;
+	flush.rows = flush.rowsSame = flush.tilesSame = flush.carried = 0;
+	start = replay_time();
+	CUBEDamageWalk(&damage, &flush, frame_budget);
+	start = replay_time() - start;
+	if (frame_budget)
+		flush.pixelCost = CUBEDamageCost(flush.pixelCost, start,
+						 totals.pixels - pixels);
+	totals.usecs += start;
+	totals.flushes++;
+	totals.same += flush.rowsSame;
+	totals.tiles += flush.tilesSame;
+	totals.carried += flush.carried;
+}
+
+/* The whole screen of the shadow as it is, in YUY2 */
+static void
+replay_full(const CUBEConverterRec *conv, u8 *out)
+{
+	int y;
+
+	for (y = 0; y < hdr.height; y++) {
+		cube_dither_row(&ctx, y);
+		conv->convert((u32 *) (out + y * hdr.width * 2),
+			      (const u32 *) (shadow + y * hdr.width * spp),
+			      hdr.width / 2, &ctx);
+	}
+}
+
+/* One replay of the whole trace; returns whether it went wrong */
+static int
+replay_run(const CUBEConverterRec *conv, int staged, policy_t policy)
+{
+	int (*convert_row)(CUBEConvertCtx *, const CUBEConverterRec *,
+			   u32 *, const u32 *, int);
+	const u8 *p = trace, *pixels;
+	CUBETraceRecord rec;
+	const CUBETraceBox *boxes;
+	replay_target target;
+	u32 frame = 0, start;
+	int i, y, w, first = 1;
+
+	convert_row = staged ? cube_convert_staged : cube_convert_runs;
+	memset(&totals, 0, sizeof(totals));
+	memset(shadow, 0, hdr.width * hdr.height * spp);
+	replay_full(conv, dst);
+
+	/* a fresh accumulator, as the driver sets it up */
+	if (!CUBEDamageInit(&damage, hdr.width, hdr.height, tile_cache)) {
+		fprintf(stderr, "cube_replay: out of memory\n");
+		exit(1);
+	}
+	damage.gap = span_cost;
+	if (hdr.width * 2 % CUBE_BURST == 0)
+		damage.align = CUBE_BURST / 2;
+	target.convert_row = convert_row;
+	target.conv = conv;
+	memset(&flush, 0, sizeof(flush));
+	flush.shadow = shadow;
+	flush.pitch = hdr.width * spp;
+	flush.bpp = spp;
+	flush.convert = replay_convert;
+	flush.arg = &target;
+
+	while (p + sizeof(rec) <= trace_end) {
+		memcpy(&rec, p, sizeof(rec));
+		boxes = (const CUBETraceBox *) (p + sizeof(rec));
+		pixels = (const u8 *) (boxes + rec.boxes);
+		if (pixels > trace_end)
+			break;
+		for (i = 0; i < rec.boxes; i++) {
+			if (boxes[i].x1 > boxes[i].x2 || boxes[i].x2 > hdr.width ||
+			    boxes[i].y1 > boxes[i].y2 || boxes[i].y2 > hdr.height) {
+				fprintf(stderr, "cube_replay: bad box, trace ends early\n");
+				p = trace_end;
+				break;
+			}
+			pixels += (boxes[i].x2 - boxes[i].x1) *
+				  (boxes[i].y2 - boxes[i].y1) * spp;
+		}
+		if (p == trace_end || pixels > trace_end)
+			break;
+
+		if (rec.type == CUBE_TRACE_RESET) {
+			/* a new generation: an empty shadow and the screen to match, untimed */
+			replay_flush(0);
+			memset(shadow, 0, hdr.width * hdr.height * spp);
+			replay_full(conv, dst);
+			CUBEDamageClear(&damage);
+			CUBEDamageInvalidate(&damage);
+			first = 1;
+			p = pixels;
+			continue;
+		}
+
+		/* a frame's worth collected: flushed at the retrace */
+		if (policy == FRAMES && !first && rec.time - frame >= period)
+			replay_flush(budget);
+		if (first || rec.time - frame >= period)
+			frame = rec.time;
+		first = 0;
+
+		/* the pixels drawn, whatever the policy */
+		pixels = (const u8 *) (boxes + rec.boxes);
+		for (i = 0; i < rec.boxes; i++) {
+			w = (boxes[i].x2 - boxes[i].x1) * spp;
+			for (y = boxes[i].y1; y < boxes[i].y2; y++, pixels += w)
+				memcpy(shadow + (y * hdr.width + boxes[i].x1) * spp,
+				       pixels, w);
+		}
+
+		if (policy == BOXES) {
+			start = replay_time();
+			for (i = 0; i < rec.boxes; i++)
+				for (y = boxes[i].y1; y < boxes[i].y2; y++)
+					if (boxes[i].x1 < boxes[i].x2)
+						replay_span(convert_row, conv, y,
+							    boxes[i].x1, boxes[i].x2);
+			totals.usecs += replay_time() - start;
+			totals.flushes++;
+		} else {
+			for (i = 0; i < rec.boxes; i++)
+				CUBEDamageAdd(&damage, boxes[i].x1, boxes[i].y1,
+					      boxes[i].x2, boxes[i].y2);
+			if (policy == BATCHES)
+				replay_flush(0);
+		}
+		p = pixels;
+	}
+	/* whatever FrameBudget still holds back */
+	replay_flush(0);
+	CUBEDamageFree(&damage);
+	if (p < trace_end && !warned) {
+		fprintf(stderr, "cube_replay: the trace is cut short, replaying"
+			" %ld of %ld bytes\n", (long) (p - trace),
+			(long) (trace_end - trace));
+		warned = 1;
+	}
+
+	printf("%-10s %5d  %-6s  %-7s  %9.2f %8lu %11lu %11lu %8lu %8lu %7lu\n",
+	       conv->name, conv->depth, strategy_names[staged],
+	       policy_names[policy], totals.usecs / 1000.0, totals.flushes,
+	       totals.pixels, totals.pixels * 2, totals.same, totals.tiles,
+	       totals.carried);
+	fflush(stdout);
+
+	replay_full(conv, want);
+	if (memcmp(want, dst, hdr.width * hdr.height * 2)) {
+		fprintf(stderr, "cube_replay: %s, %s writes, %s: the picture differs\n",
+			conv->name, strategy_names[staged], policy_names[policy]);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: cube_replay [-p usecs] [-b usecs] [-c pixels] [-t]"
+		" trace\n                   [converter...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const CUBEConverterRec *conv;
+	int i, opt, staged, policy, bad = 0;
+
+	while ((opt = getopt(argc, argv, "p:b:c:t")) != -1) {
+		switch (opt) {
+		case 'p':
+			period = atoi(optarg);
+			break;
+		case 'b':
+			budget = atoi(optarg);
+			break;
+		case 'c':
+			span_cost = atoi(optarg);
+			break;
+		case 't':
+			tile_cache = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || !period || span_cost < 0)
+		usage();
+	replay_load(argv[optind++]);
+
+	shadow = malloc(hdr.width * hdr.height * spp);
+	dst = malloc(hdr.width * hdr.height * 2);
+	want = malloc(hdr.width * hdr.height * 2);
+	if (!shadow || !dst || !want) {
+		fprintf(stderr, "cube_replay: out of memory\n");
+		return 1;
+	}
+
+	initRGB2YUVTables();
+	cube_convert_init(&ctx);
+
+	printf("%dx%d at depth %d%s, %ld bytes of trace\n", hdr.width, hdr.height,
+	       hdr.depth, hdr.scale > 1 ? " (scaled up in the driver)" : "",
+	       (long) (trace_end - trace));
+	printf("%-10s %5s  %-6s  %-7s  %9s %8s %11s %11s %8s %8s %7s\n",
+	       "converter", "depth", "writes", "policy", "msecs", "flushes",
+	       "pixels", "bytes", "rowsame", "tilesame", "carried");
+
+	for (conv = CUBEConverters; conv->name; conv++) {
+		if (conv->depth != hdr.depth)
+			continue;
+		if (optind < argc) {
+			for (i = optind; i < argc && strcmp(argv[i], conv->name); i++)
+				;
+			if (i == argc)
+				continue;
+		}
+		if (conv->setup && !conv->setup()) {
+			fprintf(stderr, "cube_replay: %s unavailable\n", conv->name);
+			continue;
+		}
+		cube_convert_rows(&ctx, conv, hdr.width / 2);
+		for (staged = 0; staged <= 1; staged++)
+			for (policy = 0; policy < POLICIES; policy++)
+				bad |= replay_run(conv, staged, policy);
+		if (conv->release)
+			conv->release();
+	}
+
+	return bad;
+}
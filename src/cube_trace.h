@@ -0,0 +1,47 @@
+/*
+   Gamecube/Wii framebuffer driver: the trace Option "CaptureFile" writes and
+   cube_replay reads back. Nothing in here knows about the X server.
+
+   A CUBETraceHeader with the shadow's geometry, then records. A damage
+   record is a CUBETraceRecord, its boxes, and for each box in turn the
+   shadow pixels it covers as they were when it was handed over, row by row,
+   (x2 - x1) * bpp / 8 bytes a row; a batch of more boxes than a record can
+   count comes as several records with the same time. A reset record stands for a new server
+   generation: the shadow is all zeroes again and the screen black. All in
+   the byte order of the machine it was captured on, which the magic tells.
+*/
+
+#ifndef CUBE_TRACE_H
+#define CUBE_TRACE_H
+
+#include "cube_convert.h"
+
+#define CUBE_TRACE_MAGIC   0x43554254u	/* "CUBT" */
+#define CUBE_TRACE_VERSION 1
+
+typedef struct {
+  u32                 magic;
+  u16                 version;
+  u16                 depth;
+  u16                 bpp;
+  u16                 width;      /* of the shadow, which ShadowScale shrinks */
+  u16                 height;
+  u16                 scale;      /* ShadowScale */
+} CUBETraceHeader;
+
+typedef enum {
+  CUBE_TRACE_DAMAGE = 1,
+  CUBE_TRACE_RESET
+} CUBETraceType;
+
+typedef struct {
+  u16                 type;       /* CUBETraceType */
+  u16                 boxes;
+  u32                 time;       /* usecs, see CUBETime(); wraps */
+} CUBETraceRecord;
+
+typedef struct {
+  u16                 x1, y1, x2, y2;
+} CUBETraceBox;
+
+#endif /* CUBE_TRACE_H */